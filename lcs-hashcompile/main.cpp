@@ -0,0 +1,48 @@
+#include <cstdio>
+#include <lcs/error.hpp>
+#include <lcs/hashtable.hpp>
+
+using namespace LCS;
+
+#ifdef WIN32
+#define print_path(name, path) wprintf(L"%s: %s\n", L ## name, path.c_str())
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include <shellapi.h>
+#include <processenv.h>
+#define make_main(body) int main() { auto argc = 0; auto argv = CommandLineToArgvW(GetCommandLineW(), &argc); body }
+#else
+#define print_path(name, path) printf("%s%s\n", name, path.c_str())
+#define make_main(body) int main(int argc, char** argv) { body }
+#endif
+
+make_main({
+    try {
+        fs::path source;
+        if (argc > 1) {
+            source = argv[1];
+        } else {
+            source = fs::path(argv[0]).parent_path() / "hashes.game.txt";
+        }
+        fs::path dest;
+        if (argc > 2) {
+            dest = argv[2];
+        } else {
+            dest = source;
+            dest.replace_extension(".bin");
+        }
+
+        print_path("Reading", source);
+        HashTable hashtable = {};
+        hashtable.add_from_file(source);
+        print_path("Writing", dest);
+        hashtable.write_compiled(dest);
+        printf("Finished!\n");
+    } catch(std::runtime_error const& error) {
+        error_print(error);
+        if (argc < 3) {
+            printf("Press enter to exit...!\n");
+            getc(stdin);
+        }
+    }
+})
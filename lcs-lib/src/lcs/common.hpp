@@ -13,6 +13,7 @@ namespace LCS {
     class ProgressMulti;
     struct File;
     struct InFile;
+    struct InMap;
     struct OutFile;
     struct Mod;
     struct ModIndex;
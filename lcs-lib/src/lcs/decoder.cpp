@@ -0,0 +1,100 @@
+#include "decoder.hpp"
+#include "error.hpp"
+#include <memory>
+#include <miniz.h>
+#include <zstd.h>
+
+using namespace LCS;
+
+Decoder::Decoder() noexcept {}
+
+Decoder::~Decoder() noexcept {
+    if (zstd_) {
+        ZSTD_freeDCtx(zstd_);
+    }
+    for (auto stream: { zlib_, raw_ }) {
+        if (stream) {
+            mz_inflateEnd(stream);
+            delete stream;
+        }
+    }
+}
+
+Decoder& Decoder::local() noexcept {
+    thread_local Decoder instance = {};
+    return instance;
+}
+
+std::size_t Decoder::zstd(void* dst, std::size_t dstSize, void const* src, std::size_t srcSize) {
+    if (!zstd_) {
+        zstd_ = ZSTD_createDCtx();
+        lcs_assert(zstd_);
+    }
+    auto const result = ZSTD_decompressDCtx(zstd_, dst, dstSize, src, srcSize);
+    lcs_assert_msg("Failed to decompress zstd data!", !ZSTD_isError(result));
+    return result;
+}
+
+std::size_t Decoder::zstd(void* dst, std::size_t dstSize, void const* src, std::size_t srcSize,
+                          void const* dictionary, std::size_t dictionarySize) {
+    if (!zstd_) {
+        zstd_ = ZSTD_createDCtx();
+        lcs_assert(zstd_);
+    }
+    // Prefix is only used for next frame
+    lcs_assert(!ZSTD_isError(ZSTD_DCtx_refPrefix(zstd_, dictionary, dictionarySize)));
+    auto const result = ZSTD_decompressDCtx(zstd_, dst, dstSize, src, srcSize);
+    lcs_assert_msg("Failed to decompress zstd data!", !ZSTD_isError(result));
+    return result;
+}
+
+std::size_t Decoder::zlib(void* dst, std::size_t dstSize, void const* src, std::size_t srcSize) {
+    return inflate_stream(zlib_, MZ_DEFAULT_WINDOW_BITS, dst, dstSize, src, srcSize);
+}
+
+std::size_t Decoder::inflate_raw(void* dst, std::size_t dstSize, void const* src, std::size_t srcSize) {
+    return inflate_stream(raw_, -MZ_DEFAULT_WINDOW_BITS, dst, dstSize, src, srcSize);
+}
+
+std::size_t Decoder::gzip(void* dst, std::size_t dstSize, void const* src, std::size_t srcSize) {
+    // miniz only inflates raw and zlib streams, skip gzip member header ourselves (RFC 1952)
+    auto const data = (unsigned char const*)src;
+    std::size_t pos = 10;
+    lcs_assert_msg("Bad gzip header!", srcSize >= pos && data[0] == 0x1F && data[1] == 0x8B && data[2] == 8);
+    auto const flags = data[3];
+    if (flags & 4) {
+        lcs_assert_msg("Bad gzip header!", srcSize >= pos + 2);
+        pos += 2 + (data[pos] | (data[pos + 1] << 8));
+    }
+    for (auto flag: { 8, 16 }) {
+        if (flags & flag) {
+            while (pos < srcSize && data[pos] != 0) {
+                pos++;
+            }
+            pos++;
+        }
+    }
+    if (flags & 2) {
+        pos += 2;
+    }
+    lcs_assert_msg("Bad gzip header!", pos <= srcSize);
+    return inflate_stream(raw_, -MZ_DEFAULT_WINDOW_BITS, dst, dstSize, data + pos, srcSize - pos);
+}
+
+std::size_t Decoder::inflate_stream(mz_stream_s*& stream, int window_bits,
+                                    void* dst, std::size_t dstSize, void const* src, std::size_t srcSize) {
+    if (!stream) {
+        auto created = std::make_unique<mz_stream>();
+        lcs_assert(mz_inflateInit2(created.get(), window_bits) == MZ_OK);
+        stream = created.release();
+    } else {
+        lcs_assert(mz_inflateReset(stream) == MZ_OK);
+    }
+    stream->next_in = (unsigned char const*)src;
+    stream->avail_in = (unsigned int)srcSize;
+    stream->next_out = (unsigned char*)dst;
+    stream->avail_out = (unsigned int)dstSize;
+    auto const result = mz_inflate(stream, MZ_FINISH);
+    lcs_assert_msg("Failed to inflate data!", result == MZ_STREAM_END || result == MZ_BUF_ERROR);
+    return (std::size_t)stream->total_out;
+}
@@ -0,0 +1,50 @@
+#ifndef LCS_DECODER_HPP
+#define LCS_DECODER_HPP
+#include "common.hpp"
+
+struct ZSTD_DCtx_s;
+struct mz_stream_s;
+
+namespace LCS {
+    // Keeps decompression contexts alive between calls, contexts are created on first use.
+    // Every decode function returns number of bytes written.
+    struct Decoder {
+        Decoder() noexcept;
+        Decoder(Decoder const&) = delete;
+        Decoder(Decoder&&) = delete;
+        Decoder& operator=(Decoder const&) = delete;
+        Decoder& operator=(Decoder&&) = delete;
+        ~Decoder() noexcept;
+
+        // Decoder owned by calling thread
+        static Decoder& local() noexcept;
+
+        // Throws std::runtime_error
+        // Output that does not fit into dstSize is an error
+        std::size_t zstd(void* dst, std::size_t dstSize, void const* src, std::size_t srcSize);
+
+        // Throws std::runtime_error
+        // Output that does not fit into dstSize is an error, dictionary is raw content, as used by EncoderDictionary
+        std::size_t zstd(void* dst, std::size_t dstSize, void const* src, std::size_t srcSize,
+                         void const* dictionary, std::size_t dictionarySize);
+
+        // Throws std::runtime_error
+        // Output that does not fit into dstSize is dropped, same for inflate_raw and gzip
+        std::size_t zlib(void* dst, std::size_t dstSize, void const* src, std::size_t srcSize);
+
+        // Throws std::runtime_error
+        std::size_t inflate_raw(void* dst, std::size_t dstSize, void const* src, std::size_t srcSize);
+
+        // Throws std::runtime_error
+        std::size_t gzip(void* dst, std::size_t dstSize, void const* src, std::size_t srcSize);
+    private:
+        ZSTD_DCtx_s* zstd_ = nullptr;
+        mz_stream_s* zlib_ = nullptr;
+        mz_stream_s* raw_ = nullptr;
+
+        static std::size_t inflate_stream(mz_stream_s*& stream, int window_bits,
+                                          void* dst, std::size_t dstSize, void const* src, std::size_t srcSize);
+    };
+}
+
+#endif // LCS_DECODER_HPP
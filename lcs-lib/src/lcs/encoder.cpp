@@ -0,0 +1,89 @@
+#include "encoder.hpp"
+#include "error.hpp"
+#include <algorithm>
+#include <vector>
+#include <zstd.h>
+
+using namespace LCS;
+
+EncoderDictionary::EncoderDictionary(void const* data, std::size_t size, int level) {
+    zstd_ = ZSTD_createCDict_advanced(data, size, ZSTD_dlm_byCopy, ZSTD_dct_rawContent,
+                                      ZSTD_getCParams(level, 0, size), ZSTD_defaultCMem);
+    lcs_assert(zstd_);
+}
+
+EncoderDictionary::~EncoderDictionary() noexcept {
+    ZSTD_freeCDict(zstd_);
+}
+
+Encoder::Encoder() noexcept {}
+
+Encoder::~Encoder() noexcept {
+    if (zstd_) {
+        ZSTD_freeCCtx(zstd_);
+    }
+}
+
+Encoder& Encoder::local() noexcept {
+    thread_local Encoder instance = {};
+    return instance;
+}
+
+std::size_t Encoder::zstd_bound(std::size_t srcSize) noexcept {
+    return ZSTD_compressBound(srcSize);
+}
+
+void Encoder::reset(int level, int windowLog, bool longDistance) {
+    if (!zstd_) {
+        zstd_ = ZSTD_createCCtx();
+        lcs_assert(zstd_);
+    } else {
+        ZSTD_CCtx_reset(zstd_, ZSTD_reset_session_and_parameters);
+    }
+    lcs_assert(!ZSTD_isError(ZSTD_CCtx_setParameter(zstd_, ZSTD_c_compressionLevel, level)));
+    lcs_assert(!ZSTD_isError(ZSTD_CCtx_setParameter(zstd_, ZSTD_c_windowLog, windowLog)));
+    lcs_assert(!ZSTD_isError(ZSTD_CCtx_setParameter(zstd_, ZSTD_c_enableLongDistanceMatching, longDistance)));
+}
+
+std::size_t Encoder::zstd(void* dst, std::size_t dstSize, void const* src, std::size_t srcSize,
+                          int level, int windowLog, bool longDistance, EncoderDictionary const* dictionary) {
+    reset(level, windowLog, longDistance);
+    if (dictionary) {
+        lcs_assert(!ZSTD_isError(ZSTD_CCtx_refCDict(zstd_, dictionary->zstd_)));
+    }
+    auto const result = ZSTD_compress2(zstd_, dst, dstSize, src, srcSize);
+    lcs_assert_msg("Failed to compress zstd data!", !ZSTD_isError(result));
+    return result;
+}
+
+std::size_t Encoder::zstd_stream(std::uint64_t srcSize, int level, int windowLog, bool longDistance,
+                                 std::function<void(void* data, std::size_t size)> const& read,
+                                 std::function<void(void const* data, std::size_t size)> const& write) {
+    reset(level, windowLog, longDistance);
+    // Pledged size lets zstd pick the same parameters as a single shot compression
+    lcs_assert(!ZSTD_isError(ZSTD_CCtx_setPledgedSrcSize(zstd_, srcSize)));
+    auto inbuffer = std::vector<char>(ZSTD_CStreamInSize());
+    auto outbuffer = std::vector<char>(ZSTD_CStreamOutSize());
+    std::size_t total = 0;
+    auto remaining = srcSize;
+    for (;;) {
+        auto const size = (std::size_t)std::min<std::uint64_t>(remaining, inbuffer.size());
+        read(inbuffer.data(), size);
+        remaining -= size;
+        auto const mode = remaining == 0 ? ZSTD_e_end : ZSTD_e_continue;
+        auto input = ZSTD_inBuffer { inbuffer.data(), size, 0 };
+        std::size_t left = 0;
+        do {
+            auto output = ZSTD_outBuffer { outbuffer.data(), outbuffer.size(), 0 };
+            left = ZSTD_compressStream2(zstd_, &output, &input, mode);
+            lcs_assert_msg("Failed to compress zstd data!", !ZSTD_isError(left));
+            if (output.pos != 0) {
+                write(output.dst, output.pos);
+                total += output.pos;
+            }
+        } while (mode == ZSTD_e_end ? left != 0 : input.pos != input.size);
+        if (mode == ZSTD_e_end) {
+            return total;
+        }
+    }
+}
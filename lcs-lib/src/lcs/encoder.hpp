@@ -0,0 +1,60 @@
+#ifndef LCS_ENCODER_HPP
+#define LCS_ENCODER_HPP
+#include "common.hpp"
+#include <functional>
+
+struct ZSTD_CCtx_s;
+struct ZSTD_CDict_s;
+
+namespace LCS {
+    // Raw content zstd dictionary digested once for one level, can be shared between threads
+    struct EncoderDictionary {
+        // Throws std::runtime_error
+        EncoderDictionary(void const* data, std::size_t size, int level);
+        EncoderDictionary(EncoderDictionary const&) = delete;
+        EncoderDictionary(EncoderDictionary&&) = delete;
+        EncoderDictionary& operator=(EncoderDictionary const&) = delete;
+        EncoderDictionary& operator=(EncoderDictionary&&) = delete;
+        ~EncoderDictionary() noexcept;
+    private:
+        friend struct Encoder;
+        ZSTD_CDict_s* zstd_ = nullptr;
+    };
+
+    // Keeps compression contexts alive between calls, contexts are created on first use.
+    // Every encode function returns number of bytes written.
+    struct Encoder {
+        Encoder() noexcept;
+        Encoder(Encoder const&) = delete;
+        Encoder(Encoder&&) = delete;
+        Encoder& operator=(Encoder const&) = delete;
+        Encoder& operator=(Encoder&&) = delete;
+        ~Encoder() noexcept;
+
+        // Encoder owned by calling thread
+        static Encoder& local() noexcept;
+
+        // Largest output zstd can produce for srcSize bytes of input
+        static std::size_t zstd_bound(std::size_t srcSize) noexcept;
+
+        // Throws std::runtime_error
+        // windowLog of 0 lets zstd pick the window for given level
+        // Level and window come from dictionary when one is given
+        std::size_t zstd(void* dst, std::size_t dstSize, void const* src, std::size_t srcSize,
+                         int level, int windowLog = 0, bool longDistance = false,
+                         EncoderDictionary const* dictionary = nullptr);
+
+        // Throws std::runtime_error
+        // Compresses srcSize bytes with fixed size buffers, read must fill the whole buffer it is given,
+        // write receives compressed output in order
+        std::size_t zstd_stream(std::uint64_t srcSize, int level, int windowLog, bool longDistance,
+                                std::function<void(void* data, std::size_t size)> const& read,
+                                std::function<void(void const* data, std::size_t size)> const& write);
+    private:
+        ZSTD_CCtx_s* zstd_ = nullptr;
+
+        void reset(int level, int windowLog, bool longDistance);
+    };
+}
+
+#endif // LCS_ENCODER_HPP
@@ -1,45 +1,292 @@
 #include "hashtable.hpp"
 #include "error.hpp"
-#include <fstream>
+#include "iofile.hpp"
+#include "parallel.hpp"
+#include <algorithm>
+#include <array>
+#include <bit>
 #include <charconv>
+#include <cstring>
 
 using namespace LCS;
 
-void HashTable::add_from_file(fs::path const& path) {
-    lcs_trace_func(
-                lcs_trace_var(path)
-                );
-    std::ifstream file(path, std::ios::binary);
-    std::string line;
-    while(std::getline(file, line) && !line.empty()) {
+namespace {
+    constexpr std::array<char, 8> COMPILED_MAGIC = { 'L', 'C', 'S', 'H', 'A', 'S', 'H', 'S' };
+    constexpr std::uint32_t COMPILED_VERSION = 1;
+
+    struct CompiledHeader {
+        std::array<char, 8> magic;
+        std::uint32_t version;
+        std::uint32_t count;
+        std::uint64_t arenaSize;
+    };
+    static_assert(sizeof(CompiledHeader) % alignof(std::uint64_t) == 0);
+
+    // Parses 16 hex digits with 8 digits per 64bit word, returns false on any non hex digit
+    inline bool parse_hex16(char8_t const* str, std::uint64_t& result) noexcept {
+        constexpr std::uint64_t ONES = 0x0101010101010101ull;
+        constexpr std::uint64_t HIGH = 0x8080808080808080ull;
+        std::uint64_t words[2];
+        std::memcpy(words, str, sizeof(words));
+        result = 0;
+        for (auto word: words) {
+            if (word & HIGH) {
+                return false;
+            }
+            // Only letters are case folded, folding everything would turn bytes 0x10-0x19 into digits
+            auto const lower = word | ONES * 0x20;
+            auto const digit = (word + ONES * (0x80 - '0')) & ~(word + ONES * (0x80 - '9' - 1)) & HIGH;
+            auto const letter = (lower + ONES * (0x80 - 'a')) & ~(lower + ONES * (0x80 - 'f' - 1)) & HIGH;
+            if ((digit | letter) != HIGH) {
+                return false;
+            }
+            // First digit is in the lowest byte, fold nibble pairs towards the most significant end
+            word = (word & (ONES * 0x0F)) + (letter >> 7) * 9;
+            word = ((word << 4) | (word >> 8)) & 0x00FF00FF00FF00FFull;
+            word = ((word << 8) | (word >> 16)) & 0x0000FFFF0000FFFFull;
+            word = ((word << 16) | (word >> 32)) & 0x00000000FFFFFFFFull;
+            result = (result << 32) | word;
+        }
+        return true;
+    }
+
+    inline bool parse_hex(std::u8string_view hex, std::uint64_t& result) noexcept {
+        if constexpr (std::endian::native == std::endian::little) {
+            if (hex.size() == 16) {
+                return parse_hex16(hex.data(), result);
+            }
+        }
+        auto const start = reinterpret_cast<char const*>(hex.data());
+        auto const end = start + hex.size();
+        auto const parsed = std::from_chars(start, end, result, 16);
+        return parsed.ec == std::errc{} && parsed.ptr == end;
+    }
+
+    // True when path is already in normal generic form, anything else takes the slow path
+    inline bool is_plain_path(std::u8string_view path) noexcept {
+        std::size_t component = 0;
+        for (std::size_t i = 0; i <= path.size(); i++) {
+            auto const c = i == path.size() ? u8'/' : path[i];
+            if (c == u8'\\' || c == u8':') {
+                return false;
+            }
+            if (c != u8'/') {
+                continue;
+            }
+            auto const name = path.substr(component, i - component);
+            if (name.empty() || name.size() > 127 || name == u8"." || name == u8"..") {
+                return false;
+            }
+            component = i + 1;
+        }
+        return true;
+    }
+
+    // Accepted paths are always equal to their normal generic form so they can be kept as views into line
+    std::optional<std::pair<std::uint64_t, std::u8string_view>> parse_line(std::u8string_view line,
+                                                                         HashTable::Filter const& filter) {
         auto space = line.find_first_of(u8' ');
-        if (space == std::u8string::npos) {
-            continue;
+        if (space == std::u8string_view::npos) {
+            return std::nullopt;
+        }
+        std::u8string_view line_hex = line.substr(0, space);
+        std::u8string_view line_path = line.substr(space + 1);
+        uint64_t hash;
+        if (!parse_hex(line_hex, hash)) {
+            return std::nullopt;
+        }
+        if (filter && !std::binary_search(filter->begin(), filter->end(), hash)) {
+            return std::nullopt;
+        }
+        if (is_plain_path(line_path)) {
+            return std::pair { hash, line_path };
         }
-        std::u8string_view line_hex = { (char8_t const*)line.data(), space };
-        std::u8string_view line_path = { (char8_t const*)line.data() + space + 1, line.size() - space - 1 };
         fs::path path_converted = line_path;
         std::u8string normal = path_converted.lexically_normal().generic_u8string();
         if (normal != line_path) {
-            continue;
+            return std::nullopt;
         }
-        bool good = true;
         for(auto const& component: path_converted) {
             if (component.native().size() > 127) {
-                good = false;
-                break;
+                return std::nullopt;
             }
         }
-        if (!good) {
-            continue;
+        return std::pair { hash, line_path };
+    }
+
+    struct Arena {
+        std::vector<std::uint64_t> hashes;
+        std::vector<std::uint32_t> offsets;
+        std::u8string arena;
+    };
+
+    // Entries must be sorted by hash and unique
+    HashTable::Table build_table(std::vector<std::pair<std::uint64_t, std::u8string_view>> const& entries) {
+        lcs_assert(entries.size() < UINT32_MAX);
+        std::size_t arenaSize = 0;
+        for (auto const& [hash, name]: entries) {
+            arenaSize += name.size();
         }
-        uint64_t hash;
-        auto const start = reinterpret_cast<char const*>(line_hex.data());
-        auto const end = start + line_hex.size();
-        auto const result = std::from_chars(start, end, hash, 16);
-        if (result.ec != std::errc{} || result.ptr != end) {
-            continue;
+        lcs_assert(arenaSize < UINT32_MAX);
+        auto storage = std::make_shared<Arena>();
+        storage->hashes.reserve(entries.size());
+        storage->offsets.reserve(entries.size() + 1);
+        storage->arena.reserve(arenaSize);
+        storage->offsets.push_back(0);
+        for (auto const& [hash, name]: entries) {
+            storage->hashes.push_back(hash);
+            storage->arena += name;
+            storage->offsets.push_back(static_cast<std::uint32_t>(storage->arena.size()));
+        }
+        auto table = HashTable::Table {};
+        table.hashes = storage->hashes;
+        table.offsets = storage->offsets;
+        table.arena = storage->arena;
+        table.storage = std::move(storage);
+        return table;
+    }
+
+    // Sorts entries by hash, when a hash repeats the entry that came last is kept
+    void sort_unique(std::vector<std::pair<std::uint64_t, std::u8string_view>>& entries) {
+        std::stable_sort(entries.begin(), entries.end(), [](auto const& lhs, auto const& rhs) {
+            return lhs.first < rhs.first;
+        });
+        auto out = entries.begin();
+        for (auto i = entries.begin(); i != entries.end(); i++) {
+            if (auto next = i + 1; next != entries.end() && next->first == i->first) {
+                continue;
+            }
+            *out++ = *i;
+        }
+        entries.erase(out, entries.end());
+    }
+}
+
+std::optional<std::u8string_view> HashTable::Table::find(uint64_t hash) const noexcept {
+    auto const i = std::lower_bound(hashes.begin(), hashes.end(), hash);
+    if (i == hashes.end() || *i != hash) {
+        return std::nullopt;
+    }
+    auto const index = static_cast<std::size_t>(i - hashes.begin());
+    return arena.substr(offsets[index], offsets[index + 1] - offsets[index]);
+}
+
+void HashTable::add_from_file(fs::path const& path, Filter const& filter) {
+    lcs_trace_func(
+                lcs_trace_var(path),
+                lcs_trace_var(filter.has_value())
+                );
+    lcs_assert(!filter || std::is_sorted(filter->begin(), filter->end()));
+    auto map = std::make_shared<InMap const>(path);
+    if (map->size() >= sizeof(CompiledHeader)
+            && std::memcmp(map->data(), COMPILED_MAGIC.data(), COMPILED_MAGIC.size()) == 0) {
+        add_compiled(std::move(map), filter);
+    } else {
+        // Text is copied into an arena so the mapping can be released
+        add_text({ (char8_t const*)map->data(), map->size() }, filter);
+    }
+}
+
+void HashTable::add_text(std::u8string_view data, Filter const& filter) {
+    // Parsing stops at the first empty line
+    if (auto const empty = data.starts_with(u8'\n') ? 0 : data.find(u8"\n\n"); empty != std::u8string_view::npos) {
+        data = data.substr(0, empty);
+    }
+    // Split into chunks at line boundaries, chunks are merged back in order so later lines still win
+    auto const chunkCount = std::max<std::size_t>(1, std::min(default_jobs() * 4, data.size() / (256 * 1024)));
+    auto bounds = std::vector<std::size_t>{ 0 };
+    for (std::size_t chunk = 1; chunk != chunkCount; chunk++) {
+        auto const newline = data.find(u8'\n', std::max(bounds.back(), data.size() / chunkCount * chunk));
+        if (newline == std::u8string_view::npos) {
+            break;
+        }
+        bounds.push_back(newline + 1);
+    }
+    bounds.push_back(data.size());
+    auto parsed = std::vector<std::vector<std::pair<std::uint64_t, std::u8string_view>>>(bounds.size() - 1);
+    parallel_for(parsed.size(), 0, [&] (std::size_t chunk) {
+        auto lines = data.substr(bounds[chunk], bounds[chunk + 1] - bounds[chunk]);
+        auto& result = parsed[chunk];
+        while (!lines.empty()) {
+            auto const newline = lines.find(u8'\n');
+            auto const line = lines.substr(0, newline);
+            lines = newline == std::u8string_view::npos ? std::u8string_view{} : lines.substr(newline + 1);
+            if (auto entry = parse_line(line, filter)) {
+                result.push_back(*entry);
+            }
+        }
+    });
+    std::size_t total = 0;
+    for (auto const& chunk: parsed) {
+        total += chunk.size();
+    }
+    auto entries = std::vector<std::pair<std::uint64_t, std::u8string_view>>{};
+    entries.reserve(total);
+    for (auto& chunk: parsed) {
+        entries.insert(entries.end(), chunk.begin(), chunk.end());
+        chunk = {};
+    }
+    sort_unique(entries);
+    tables_.push_back(build_table(entries));
+}
+
+void HashTable::add_compiled(std::shared_ptr<InMap const> map, Filter const& filter) {
+    auto const data = map->span(0, map->size());
+    CompiledHeader header;
+    std::memcpy(&header, data.data(), sizeof(CompiledHeader));
+    lcs_assert(header.version == COMPILED_VERSION);
+    auto const hashesSize = std::uint64_t{header.count} * sizeof(std::uint64_t);
+    auto const offsetsSize = (std::uint64_t{header.count} + 1) * sizeof(std::uint32_t);
+    lcs_assert(sizeof(CompiledHeader) + hashesSize + offsetsSize + header.arenaSize == data.size());
+    auto const hashes = map->span(sizeof(CompiledHeader), hashesSize);
+    auto const offsets = map->span(sizeof(CompiledHeader) + hashesSize, offsetsSize);
+    auto const arena = map->span(sizeof(CompiledHeader) + hashesSize + offsetsSize, header.arenaSize);
+    auto table = Table {};
+    table.hashes = { (std::uint64_t const*)hashes.data(), header.count };
+    table.offsets = { (std::uint32_t const*)offsets.data(), std::size_t{header.count} + 1 };
+    table.arena = { (char8_t const*)arena.data(), arena.size() };
+    lcs_assert(std::is_sorted(table.hashes.begin(), table.hashes.end()));
+    lcs_assert(table.offsets.front() == 0 && table.offsets.back() == header.arenaSize);
+    lcs_assert(std::is_sorted(table.offsets.begin(), table.offsets.end()));
+    table.storage = std::move(map);
+    if (filter) {
+        // Copy out only the wanted paths and let go of the mapping
+        auto entries = std::vector<std::pair<std::uint64_t, std::u8string_view>>{};
+        for (auto const hash: *filter) {
+            if (auto name = table.find(hash); name && (entries.empty() || entries.back().first != hash)) {
+                entries.emplace_back(hash, *name);
+            }
+        }
+        table = build_table(entries);
+    }
+    tables_.push_back(std::move(table));
+}
+
+void HashTable::write_compiled(fs::path const& path) const {
+    lcs_trace_func(
+                lcs_trace_var(path)
+                );
+    auto table = tables_.size() == 1 ? tables_.front() : Table {};
+    if (tables_.size() != 1) {
+        // Later tables win, same as find()
+        auto entries = std::vector<std::pair<std::uint64_t, std::u8string_view>>{};
+        for (auto const& t: tables_) {
+            for (std::size_t i = 0; i != t.hashes.size(); i++) {
+                entries.emplace_back(t.hashes[i], t.arena.substr(t.offsets[i], t.offsets[i + 1] - t.offsets[i]));
+            }
         }
-        hashes_.insert_or_assign(hash, path_converted.lexically_normal());
+        sort_unique(entries);
+        table = build_table(entries);
     }
+    auto const header = CompiledHeader {
+        COMPILED_MAGIC,
+        COMPILED_VERSION,
+        static_cast<std::uint32_t>(table.hashes.size()),
+        static_cast<std::uint64_t>(table.arena.size()),
+    };
+    auto outfile = OutFile(path);
+    outfile.write(&header, sizeof(header));
+    outfile.write(table.hashes.data(), table.hashes.size_bytes());
+    outfile.write(table.offsets.data(), table.offsets.size_bytes());
+    outfile.write(table.arena.data(), table.arena.size());
 }
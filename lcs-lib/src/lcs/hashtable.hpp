@@ -1,20 +1,49 @@
 #ifndef LCS_HASHTABLE_HPP
 #define LCS_HASHTABLE_HPP
 #include "common.hpp"
-#include <unordered_map>
+#include <memory>
 #include <optional>
+#include <span>
+#include <string_view>
+#include <vector>
 
 namespace LCS {
     struct HashTable {
-        void add_from_file(fs::path const& path);
-        inline std::optional<fs::path> find(uint64_t hash) const noexcept {
-            if (auto i = hashes_.find(hash); i != hashes_.end()) {
-                return i->second;
+        // Sorted hashes, offsets[count + 1] into one UTF-8 arena of generic paths
+        // storage keeps either the mapped compiled file or the arena built from a text list alive
+        struct Table {
+            std::shared_ptr<void const> storage;
+            std::span<std::uint64_t const> hashes;
+            std::span<std::uint32_t const> offsets;
+            std::u8string_view arena;
+
+            std::optional<std::u8string_view> find(uint64_t hash) const noexcept;
+        };
+
+        // Sorted hashes to keep, everything else in the file is skipped
+        using Filter = std::optional<std::span<std::uint64_t const>>;
+
+        // Throws std::runtime_error
+        // Accepts both hashes.game.txt text lists and tables written by write_compiled
+        void add_from_file(fs::path const& path, Filter const& filter = std::nullopt);
+
+        // Throws std::runtime_error
+        void write_compiled(fs::path const& path) const;
+
+        // Later files take precedence
+        inline std::optional<std::u8string_view> find(uint64_t hash) const noexcept {
+            for (auto t = tables_.rbegin(); t != tables_.rend(); t++) {
+                if (auto result = t->find(hash)) {
+                    return result;
+                }
             }
             return std::nullopt;
         }
     private:
-        std::unordered_map<uint64_t, fs::path> hashes_;
+        std::vector<Table> tables_;
+
+        void add_text(std::u8string_view data, Filter const& filter);
+        void add_compiled(std::shared_ptr<InMap const> map, Filter const& filter);
     };
 }
 
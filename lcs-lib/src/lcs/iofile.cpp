@@ -3,7 +3,24 @@
 #endif
 #include "iofile.hpp"
 #include "error.hpp"
+#include <algorithm>
+#include <cerrno>
 #include <string.h>
+#ifdef WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include <io.h>
+#else
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <linux/fs.h>
+#include <sys/sendfile.h>
+#endif
+#endif
 
 using namespace LCS;
 
@@ -100,3 +117,203 @@ std::int64_t File::size() {
     seek(cur, SEEK_SET);
     return result;
 }
+
+void File::resize(std::uint64_t size) {
+    lcs_trace_func(
+                lcs_trace_var(path_),
+                lcs_trace_var(size)
+                );
+    lcs_assert(fflush((FILE*)handle_) == 0);
+#ifdef WIN32
+    lcs_assert(_chsize_s(_fileno((FILE*)handle_), (std::int64_t)size) == 0);
+#else
+    lcs_assert(ftruncate(fileno((FILE*)handle_), (off_t)size) == 0);
+#endif
+}
+
+#ifdef __linux__
+// Copies at given offsets without touching file positions, returns how much got copied from the start
+static std::uint64_t kernel_copy(int srcfd, std::uint64_t srcoff, int dstfd, std::uint64_t dstoff,
+                                 std::uint64_t size) noexcept {
+    std::uint64_t done = 0;
+    while (done != size) {
+        auto in = (loff_t)(srcoff + done);
+        auto out = (loff_t)(dstoff + done);
+        auto const result = copy_file_range(srcfd, &in, dstfd, &out, size - done, 0);
+        if (result <= 0) {
+            break;
+        }
+        done += (std::uint64_t)result;
+    }
+    // Older kernels and cross filesystem copies, sendfile writes at the file position
+    if (done != size && lseek(dstfd, (off_t)(dstoff + done), SEEK_SET) >= 0) {
+        while (done != size) {
+            auto in = (off_t)(srcoff + done);
+            auto const result = sendfile(dstfd, srcfd, &in, size - done);
+            if (result <= 0) {
+                break;
+            }
+            done += (std::uint64_t)result;
+        }
+    }
+    return done;
+}
+#endif
+
+void File::copy(FILE* src, std::uint64_t offset, std::uint64_t size) {
+    lcs_trace_func(
+                lcs_trace_var(path_),
+                lcs_trace_var(offset),
+                lcs_trace_var(size)
+                );
+    auto const position = tell();
+    std::uint64_t done = 0;
+#ifdef __linux__
+    if (offload_ && size != 0) {
+        lcs_assert(fflush((FILE*)handle_) == 0);
+        auto const srcfd = fileno(src);
+        auto const dstfd = fileno((FILE*)handle_);
+        // Whole blocks can share storage on copy on write filesystems when both sides sit at the same place
+        // within a block, only the unaligned head and tail are copied
+        constexpr std::uint64_t BLOCK = CLONE_BLOCK;
+        auto const head = (BLOCK - offset % BLOCK) % BLOCK;
+        if (clone_ && offset % BLOCK == (std::uint64_t)position % BLOCK && head + BLOCK <= size) {
+            auto const body = (size - head) / BLOCK * BLOCK;
+            auto range = file_clone_range { srcfd, offset + head, body, (std::uint64_t)position + head };
+            done = kernel_copy(srcfd, offset, dstfd, position, head);
+            if (done == head) {
+                if (ioctl(dstfd, FICLONERANGE, &range) == 0) {
+                    done += body;
+                } else if (errno == EOPNOTSUPP || errno == EXDEV || errno == EINVAL || errno == ENOTTY) {
+                    clone_ = false;
+                }
+            }
+        }
+        // Picks up after whatever got cloned or copied above
+        done += kernel_copy(srcfd, offset + done, dstfd, position + done, size - done);
+        offload_ = done != 0;
+        seek(position + done, SEEK_SET);
+    }
+#endif
+    if (done != size) {
+#ifdef WIN32
+        lcs_assert(_fseeki64(src, offset + done, SEEK_SET) == 0);
+#else
+        lcs_assert(fseek(src, offset + done, SEEK_SET) == 0);
+#endif
+        char buffer[64 * 1024];
+        while (done != size) {
+            auto const chunk = (std::size_t)std::min<std::uint64_t>(size - done, sizeof(buffer));
+            lcs_assert(fread(buffer, 1, chunk, src) == chunk);
+            write(buffer, chunk);
+            done += chunk;
+        }
+    }
+}
+
+InMap::InMap(fs::path const& path)
+    : path_(path), data_(nullptr), size_(0)
+#ifdef WIN32
+    , file_(INVALID_HANDLE_VALUE), mapping_(nullptr)
+#endif
+{
+    lcs_trace_func(
+                lcs_trace_var(path)
+                );
+    lcs_assert(fs::exists(path));
+    lcs_assert(fs::is_regular_file(path));
+#ifdef WIN32
+    file_ = CreateFileW(path_.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr,
+                        OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    auto error = file_ == INVALID_HANDLE_VALUE ? (int)GetLastError() : 0;
+    LARGE_INTEGER size = {};
+    if (!error && !GetFileSizeEx((HANDLE)file_, &size)) {
+        error = (int)GetLastError();
+    }
+    if (!error && size.QuadPart > 0) {
+        mapping_ = CreateFileMappingW((HANDLE)file_, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        if (!mapping_) {
+            error = (int)GetLastError();
+        } else if (auto view = MapViewOfFile((HANDLE)mapping_, FILE_MAP_READ, 0, 0, 0)) {
+            data_ = (std::byte const*)view;
+            size_ = (std::size_t)size.QuadPart;
+        } else {
+            error = (int)GetLastError();
+        }
+    }
+    if (error != 0) {
+        close();
+        lcs_hint(u8"\nMAKE SURE:\n"
+               "\t1. its not opened by something else already (for example: another modding tool)!\n"
+               "\t2. league is NOT patching (restart both league and LCS)!\n"
+               "\t3. you have sufficient priviliges (for example: run as Administrator)");
+        std::string msg = "Failed to map file: " + std::to_string(error);
+        throw_error(msg.c_str());
+    }
+#else
+    auto fd = open(path_.c_str(), O_RDONLY);
+    auto error = fd < 0 ? errno : 0;
+    struct stat info = {};
+    if (!error && fstat(fd, &info) != 0) {
+        error = errno;
+    }
+    if (!error && info.st_size > 0) {
+        auto view = mmap(nullptr, (std::size_t)info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (view == MAP_FAILED) {
+            error = errno;
+        } else {
+            data_ = (std::byte const*)view;
+            size_ = (std::size_t)info.st_size;
+        }
+    }
+    if (fd >= 0) {
+        ::close(fd);
+    }
+    if (error != 0) {
+        std::string msg = "Failed to map file: ";
+        if (auto error_details = strerror(error)) {
+            msg += error_details;
+        }
+        lcs_hint(u8"\nMAKE SURE:\n"
+               "\t1. its not opened by something else already (for example: another modding tool)!\n"
+               "\t2. you have sufficient priviliges (for example: run as Administrator)");
+        throw_error(msg.c_str());
+    }
+#endif
+}
+
+InMap::~InMap() {
+    close();
+}
+
+void InMap::close() noexcept {
+#ifdef WIN32
+    if (data_) {
+        UnmapViewOfFile(data_);
+        data_ = nullptr;
+    }
+    if (mapping_) {
+        CloseHandle((HANDLE)mapping_);
+        mapping_ = nullptr;
+    }
+    if (file_ != INVALID_HANDLE_VALUE) {
+        CloseHandle((HANDLE)file_);
+        file_ = INVALID_HANDLE_VALUE;
+    }
+#else
+    if (data_) {
+        munmap((void*)data_, size_);
+        data_ = nullptr;
+    }
+#endif
+}
+
+std::span<std::byte const> InMap::span(std::uint64_t offset, std::uint64_t size) const {
+    lcs_trace_func(
+                lcs_trace_var(path_),
+                lcs_trace_var(offset),
+                lcs_trace_var(size)
+                );
+    lcs_assert(offset <= size_ && size <= size_ - offset);
+    return { data_ + offset, (std::size_t)size };
+}
@@ -2,6 +2,7 @@
 #define LCS_IOFILE_HPP
 #include <cstdio>
 #include <memory>
+#include <span>
 
 #include "common.hpp"
 
@@ -11,7 +12,14 @@ namespace LCS {
         fs::path path_;
         bool readonly_;
         FILE* handle_;
+        // Cleared once kernel copies fail so later copies go straight to the buffer
+        bool offload_ = true;
+        // Cleared once filesystem turns down a clone so later copies do not retry it
+        bool clone_ = true;
     public:
+        // Copy on write filesystems share whole blocks, writers align data they expect to be cloned to this
+        static constexpr std::uint64_t CLONE_BLOCK = 4096;
+
         File(fs::path const& path, bool write);
         File(File const&) = delete;
         File(File&&) = delete;
@@ -27,6 +35,15 @@ namespace LCS {
         void seek(std::int64_t pos, int origin);
         std::int64_t tell() const;
         std::int64_t size();
+
+        // Throws std::runtime_error
+        // Cuts or extends file to size, position is kept
+        void resize(std::uint64_t size);
+
+        // Throws std::runtime_error
+        // Copies size bytes at offset of src to current position and moves past them.
+        // Kernel clones or copies the range when it can, otherwise goes through a small buffer.
+        void copy(FILE* src, std::uint64_t offset, std::uint64_t size);
     };
 
     struct InFile {
@@ -81,6 +98,46 @@ namespace LCS {
         inline std::int64_t size() {
             return file_.size();
         }
+
+        // Throws std::runtime_error
+        inline void resize(std::uint64_t size) {
+            file_.resize(size);
+        }
+
+        // Throws std::runtime_error
+        inline void copy(InFile& src, std::uint64_t offset, std::uint64_t size) {
+            file_.copy(src.raw(), offset, size);
+        }
+    };
+
+    struct InMap {
+    private:
+        fs::path path_;
+        std::byte const* data_;
+        std::size_t size_;
+#ifdef WIN32
+        void* file_;
+        void* mapping_;
+#endif
+        void close() noexcept;
+    public:
+        InMap(fs::path const& path);
+        InMap(InMap const&) = delete;
+        InMap(InMap&&) = delete;
+        InMap& operator=(InMap const&) = delete;
+        InMap& operator=(InMap&&) = delete;
+        ~InMap();
+
+        inline std::byte const* data() const noexcept {
+            return data_;
+        }
+
+        inline std::size_t size() const noexcept {
+            return size_;
+        }
+
+        // Throws std::runtime_error
+        std::span<std::byte const> span(std::uint64_t offset, std::uint64_t size) const;
     };
 }
 
@@ -0,0 +1,60 @@
+#include "parallel.hpp"
+#include "error.hpp"
+#include <exception>
+#include <mutex>
+#include <system_error>
+#include <thread>
+#include <vector>
+
+using namespace LCS;
+
+std::size_t LCS::default_jobs() noexcept {
+    return std::max(std::size_t{1}, (std::size_t)std::thread::hardware_concurrency());
+}
+
+void LCS::parallel_run(std::size_t jobs, std::function<void()> const& worker) {
+    if (jobs == 0) {
+        return;
+    }
+    if (jobs == 1) {
+        worker();
+        return;
+    }
+    std::mutex mutex;
+    std::exception_ptr error = nullptr;
+    std::u8string error_trace;
+    std::u8string hint_trace;
+    auto run = [&] () noexcept {
+        try {
+            worker();
+        } catch (...) {
+            auto lock = std::lock_guard(mutex);
+            if (!error) {
+                error = std::current_exception();
+                error_trace = error_stack_trace();
+                hint_trace = hint_stack_trace();
+            } else {
+                error_stack().clear();
+                hint_stack().clear();
+            }
+        }
+    };
+    std::vector<std::thread> threads;
+    threads.reserve(jobs - 1);
+    try {
+        while (threads.size() != jobs - 1) {
+            threads.emplace_back(run);
+        }
+    } catch (std::system_error const&) {
+        // workers share the work, running with fewer threads is fine
+    }
+    run();
+    for (auto& thread: threads) {
+        thread.join();
+    }
+    if (error) {
+        error_stack() += error_trace;
+        hint_stack() += hint_trace;
+        std::rethrow_exception(error);
+    }
+}
@@ -0,0 +1,45 @@
+#ifndef LCS_PARALLEL_HPP
+#define LCS_PARALLEL_HPP
+#include "common.hpp"
+#include <algorithm>
+#include <atomic>
+#include <functional>
+
+namespace LCS {
+    // Number of jobs used when caller asks for 0
+    extern std::size_t default_jobs() noexcept;
+
+    // Throws whatever the first failed worker threw, along with its error trace
+    // Runs worker on up to jobs threads (calling thread included) and waits for all of them
+    extern void parallel_run(std::size_t jobs, std::function<void()> const& worker);
+
+    // Throws whatever the first failed call threw, along with its error trace
+    // Calls func(state, index) for every index in [0, count), state is created by init() once per thread
+    template<typename Init, typename Func>
+    inline void parallel_for(std::size_t count, std::size_t jobs, Init&& init, Func&& func) {
+        jobs = std::min(jobs ? jobs : default_jobs(), count);
+        std::atomic<std::size_t> next = 0;
+        parallel_run(jobs, [&] {
+            try {
+                auto state = init();
+                for (std::size_t index; (index = next++) < count;) {
+                    func(state, index);
+                }
+            } catch (...) {
+                next = count;
+                throw;
+            }
+        });
+    }
+
+    // Throws whatever the first failed call threw, along with its error trace
+    // Calls func(index) for every index in [0, count)
+    template<typename Func>
+    inline void parallel_for(std::size_t count, std::size_t jobs, Func&& func) {
+        parallel_for(count, jobs, [] { return 0; }, [&func] (int, std::size_t index) {
+            func(index);
+        });
+    }
+}
+
+#endif // LCS_PARALLEL_HPP
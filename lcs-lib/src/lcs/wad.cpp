@@ -1,11 +1,16 @@
 #include "wad.hpp"
+#include "decoder.hpp"
 #include "utility.hpp"
 #include "error.hpp"
+#include "parallel.hpp"
 #include "progress.hpp"
 #include "xxhash.h"
+#include <algorithm>
 #include <charconv>
-#include <miniz.h>
-#include <zstd.h>
+#include <cstring>
+#include <map>
+#include <mutex>
+#include <set>
 #include <vector>
 
 using namespace LCS;
@@ -28,76 +33,242 @@ Wad::Wad(fs::path const& path, fs::path const& name)
     lcs_assert(dataBegin_ <= dataEnd_);
     entries_.resize(header_.filecount);
     infile.read((char*)entries_.data(), header_.filecount * sizeof(Entry));
+    check_entries();
+}
+
+Wad::Wad(fs::path const& path, fs::path const& name, std::uint64_t size,
+         Header const& header, std::vector<Entry> entries)
+    : path_(fs::absolute(path)), size_(size), name_(name), header_(header), entries_(std::move(entries)) {
+    lcs_trace_func(
+                lcs_trace_var(path),
+                lcs_trace_var(name)
+                );
+    lcs_assert(header_.magic == std::array{'R', 'W'});
+    lcs_assert(header_.version_major == 3);
+    lcs_assert(header_.filecount == entries_.size());
+    dataBegin_ = header_.filecount * sizeof(Entry) + sizeof(header_);
+    dataEnd_ = size_;
+    lcs_assert(dataBegin_ <= dataEnd_);
+    check_entries();
+}
+
+void Wad::check_entries() {
     for(auto const& entry: entries_) {
         lcs_assert(entry.dataOffset <= dataEnd_ && entry.dataOffset >= dataBegin_);
         lcs_assert(entry.dataOffset + entry.sizeCompressed <= dataEnd_);
+        if (entry.xxhash == Dictionaries::xxhash()) {
+            lcs_assert(entry.type == Entry::Uncompressed || entry.type == Entry::ZStandardCompressed);
+            has_dictionaries_ = true;
+        }
     }
 }
 
-void Wad::extract(fs::path const& dstpath, HashTable const& hashtable, Progress& progress) const {
+namespace {
+    constexpr std::array<char, 8> DICTIONARIES_MAGIC = { 'L', 'C', 'S', 'Z', 'D', 'I', 'C', 'T' };
+    constexpr std::uint32_t DICTIONARIES_VERSION = 1;
+
+    struct DictionariesHeader {
+        std::array<char, 8> magic;
+        std::uint32_t version;
+        std::uint32_t dictionaryCount;
+        std::uint32_t entryCount;
+        std::uint32_t pad;
+    };
+
+    struct DictionariesEntry {
+        std::uint64_t xxhash;
+        std::uint32_t dictionary;
+        std::uint32_t pad;
+    };
+
+    Wad::Dictionaries parse_dictionaries(std::span<std::byte const> data) {
+        DictionariesHeader header;
+        lcs_assert(data.size() >= sizeof(header));
+        std::memcpy(&header, data.data(), sizeof(header));
+        lcs_assert(header.magic == DICTIONARIES_MAGIC && header.version == DICTIONARIES_VERSION);
+        data = data.subspan(sizeof(header));
+        lcs_assert(data.size() / sizeof(std::uint32_t) >= header.dictionaryCount);
+        auto sizes = std::vector<std::uint32_t>(header.dictionaryCount);
+        std::memcpy(sizes.data(), data.data(), sizes.size() * sizeof(std::uint32_t));
+        data = data.subspan(sizes.size() * sizeof(std::uint32_t));
+        lcs_assert(data.size() / sizeof(DictionariesEntry) >= header.entryCount);
+        auto result = Wad::Dictionaries {};
+        result.entries.reserve(header.entryCount);
+        for (std::uint32_t i = 0; i != header.entryCount; i++) {
+            DictionariesEntry entry;
+            std::memcpy(&entry, data.data() + i * sizeof(entry), sizeof(entry));
+            lcs_assert(entry.dictionary < header.dictionaryCount);
+            lcs_assert(result.entries.empty() || result.entries.back().first < entry.xxhash);
+            result.entries.emplace_back(entry.xxhash, entry.dictionary);
+        }
+        data = data.subspan(header.entryCount * sizeof(DictionariesEntry));
+        for (auto const size: sizes) {
+            lcs_assert(size <= data.size());
+            result.dictionaries.push_back(data.subspan(0, size));
+            data = data.subspan(size);
+        }
+        lcs_assert(data.empty());
+        return result;
+    }
+}
+
+std::uint64_t Wad::Dictionaries::xxhash() noexcept {
+    static auto const result = [] {
+        constexpr std::u8string_view name = u8"lcs/zstd.dictionaries";
+        return XXH64(name.data(), name.size(), 0);
+    }();
+    return result;
+}
+
+Wad::Dictionaries Wad::Dictionaries::read(Entry const& entry, std::span<std::byte const> data) {
+    lcs_assert(entry.type == Entry::Uncompressed || entry.type == Entry::ZStandardCompressed);
+    if (entry.type == Entry::Uncompressed) {
+        return parse_dictionaries(data);
+    }
+    auto storage = std::make_shared<std::vector<std::byte>>(entry.sizeUncompressed);
+    auto const size = Decoder::local().zstd(storage->data(), storage->size(), data.data(), data.size());
+    lcs_assert(size == storage->size());
+    auto result = parse_dictionaries(*storage);
+    result.storage = std::move(storage);
+    return result;
+}
+
+std::vector<char> Wad::Dictionaries::write() const {
+    auto const header = DictionariesHeader {
+        DICTIONARIES_MAGIC,
+        DICTIONARIES_VERSION,
+        static_cast<std::uint32_t>(dictionaries.size()),
+        static_cast<std::uint32_t>(entries.size()),
+        {},
+    };
+    auto result = std::vector<char>{};
+    auto const append = [&result] (void const* data, std::size_t size) {
+        result.insert(result.end(), (char const*)data, (char const*)data + size);
+    };
+    append(&header, sizeof(header));
+    for (auto const& dictionary: dictionaries) {
+        lcs_assert(dictionary.size() < UINT32_MAX);
+        auto const size = static_cast<std::uint32_t>(dictionary.size());
+        append(&size, sizeof(size));
+    }
+    for (auto const& [xxhash, dictionary]: entries) {
+        auto const entry = DictionariesEntry { xxhash, dictionary, {} };
+        append(&entry, sizeof(entry));
+    }
+    for (auto const& dictionary: dictionaries) {
+        append(dictionary.data(), dictionary.size());
+    }
+    return result;
+}
+
+std::span<std::byte const> Wad::Dictionaries::find(std::uint64_t xxhash) const noexcept {
+    auto const i = std::lower_bound(entries.begin(), entries.end(), xxhash, [](auto const& entry, std::uint64_t value) {
+        return entry.first < value;
+    });
+    if (i == entries.end() || i->first != xxhash) {
+        return {};
+    }
+    return dictionaries[i->second];
+}
+
+Wad::Dictionaries Wad::dictionaries(InMap const& map) const {
     lcs_trace_func(
-                lcs_trace_var(dstpath)
+                lcs_trace_var(path_)
                 );
-    InFile infile(path_);
+    for (auto const& entry: entries_) {
+        if (entry.xxhash == Dictionaries::xxhash()) {
+            return Dictionaries::read(entry, data(map, entry));
+        }
+    }
+    return {};
+}
+
+void Wad::extract(fs::path const& dstpath, HashTable const& hashtable, Progress& progress,
+                  std::size_t jobs) const {
+    lcs_trace_func(
+                lcs_trace_var(dstpath),
+                lcs_trace_var(jobs)
+                );
+    InMap const map(path_);
+    auto const dictionaries = this->dictionaries(map);
 
     size_t totalSize = 0;
-    uint32_t maxCompressed = 0;
     uint32_t maxUncompressed = 0;
     for(auto const& entry: entries_) {
         totalSize += entry.sizeUncompressed;
-        maxCompressed = std::max(maxCompressed, entry.sizeCompressed);
         maxUncompressed = std::max(maxUncompressed, entry.sizeUncompressed);
     }
     progress.startItem(path_, totalSize);
-    std::vector<char> compressedBuffer;
-    std::vector<char> uncompressedBuffer;
-    compressedBuffer.reserve((size_t)(maxCompressed));
-    uncompressedBuffer.reserve((size_t)(maxUncompressed));
 
-    printf("Is old: %d\n", is_oldchecksum());
-    for(auto const& entry: entries_) {
-        infile.seek(entry.dataOffset, SEEK_SET);
-        if (entry.type == Entry::Uncompressed) {
-            infile.read(uncompressedBuffer.data(), entry.sizeUncompressed);
-        } else if(entry.type == Entry::ZlibCompressed) {
-            infile.read(compressedBuffer.data(), entry.sizeCompressed);
-            mz_stream strm = {};
-            lcs_assert(mz_inflateInit2(&strm, 16 + MAX_WBITS) == MZ_OK);
-            strm.next_in = (unsigned char const*)compressedBuffer.data();
-            strm.avail_in = entry.sizeCompressed;
-            strm.next_out = (unsigned char*)uncompressedBuffer.data();
-            strm.avail_out = entry.sizeUncompressed;
-            mz_inflate(&strm, MZ_FINISH);
-            mz_inflateEnd(&strm);
-        } else if(entry.type == Entry::ZStandardCompressed) {
-            infile.read(compressedBuffer.data(), entry.sizeCompressed);
-            ZSTD_decompress(uncompressedBuffer.data(), entry.sizeUncompressed,
-                            compressedBuffer.data(), entry.sizeCompressed);
-        } else if(entry.type == Entry::FileRedirection) {
-            // file_.read(uncompressedBuffer.data(), entry.sizeUncompressed);
+    // Resolve known names up front so workers never race on directories or output files.
+    // When multiple entries resolve to same file last one wins, same as extracting in order.
+    std::vector<fs::path> outpaths(entries_.size());
+    {
+        std::map<fs::path, std::size_t> owners;
+        std::set<fs::path> directories = { dstpath };
+        for (std::size_t i = 0; i != entries_.size(); i++) {
+            if (auto p = hashtable.find(entries_[i].xxhash); p) {
+                auto outpath = dstpath / fs::path(*p);
+                if (auto [owner, inserted] = owners.try_emplace(outpath, i); !inserted) {
+                    outpaths[owner->second] = fs::path{};
+                    owner->second = i;
+                }
+                directories.insert(outpath.parent_path());
+                outpaths[i] = std::move(outpath);
+            }
         }
+        for (auto const& directory: directories) {
+            fs::create_directories(directory);
+        }
+    }
+
+    printf("Is old: %d\n", is_oldchecksum());
+    std::mutex progress_mutex;
+    parallel_for(entries_.size(), jobs, [&] {
+        return std::vector<char>((size_t)(maxUncompressed));
+    }, [&, this] (std::vector<char>& uncompressedBuffer, std::size_t index) {
+        auto const& entry = entries_[index];
+        auto const& knownpath = outpaths[index];
+        bool const superseded = knownpath.empty() && hashtable.find(entry.xxhash);
+        bool const reserved = has_dictionaries_ && entry.xxhash == Dictionaries::xxhash();
+        if (entry.type != Entry::FileRedirection && !superseded && !reserved) {
+            auto const compressed = data(map, entry);
+            char const* uncompressed = uncompressedBuffer.data();
+            auto& decoder = Decoder::local();
+            if (entry.type == Entry::Uncompressed) {
+                lcs_assert(entry.sizeUncompressed <= compressed.size());
+                uncompressed = (char const*)compressed.data();
+            } else if(entry.type == Entry::ZlibCompressed) {
+                decoder.gzip(uncompressedBuffer.data(), entry.sizeUncompressed,
+                             compressed.data(), compressed.size());
+            } else if(entry.type == Entry::ZStandardCompressed) {
+                if (auto const dictionary = dictionaries.find(entry.xxhash); !dictionary.empty()) {
+                    decoder.zstd(uncompressedBuffer.data(), entry.sizeUncompressed,
+                                 compressed.data(), compressed.size(), dictionary.data(), dictionary.size());
+                } else {
+                    decoder.zstd(uncompressedBuffer.data(), entry.sizeUncompressed,
+                                 compressed.data(), compressed.size());
+                }
+            }
 
-        if (entry.type != Entry::FileRedirection) {
-            fs::path outpath = dstpath;
-            if (auto p = hashtable.find(entry.xxhash); p) {
-                outpath /= *p;
-            } else {
+            fs::path outpath = knownpath;
+            if (outpath.empty()) {
                 char hex[16];
                 auto result = std::to_chars(hex, hex + sizeof(hex), entry.xxhash, 16);
                 auto hex_str = std::u8string(hex, result.ptr);
                 hex_str.insert(hex_str.begin(), 16 - hex_str.size(), u8'0');
-                outpath /= hex_str;
-                outpath.replace_extension(ScanExtension(uncompressedBuffer.data(), entry.sizeUncompressed));
+                outpath = dstpath / hex_str;
+                outpath.replace_extension(ScanExtension(uncompressed, entry.sizeUncompressed));
             }
             lcs_trace_func(
                         lcs_trace_var(outpath)
                         );
-            fs::create_directories(outpath.parent_path());
             OutFile outfile(outpath);
-            outfile.write(uncompressedBuffer.data(), entry.sizeUncompressed);
+            outfile.write(uncompressed, entry.sizeUncompressed);
         }
+        auto lock = std::lock_guard(progress_mutex);
         progress.consumeData(entry.sizeUncompressed);
-    }
+    });
 
     progress.finishItem();
 }
@@ -5,6 +5,8 @@
 #include "iofile.hpp"
 #include <array>
 #include <cstdint>
+#include <memory>
+#include <span>
 #include <vector>
 
 namespace LCS {
@@ -38,9 +40,41 @@ namespace LCS {
         };
         static_assert (sizeof(Header) == 4 + 256 + 8 + 4);
 
+        // Raw content zstd dictionaries WadMake keeps in a reserved entry, zstd compressed or stored.
+        // Entries listed here are zstd frames that only decode with their dictionary,
+        // so such wads are only for lcs itself and WadMakeCopy turns them back into plain wads.
+        struct Dictionaries {
+            // Keeps decompressed dictionaries alive, empty when they are views into stored data
+            std::shared_ptr<void const> storage;
+            std::vector<std::span<std::byte const>> dictionaries;
+            // Sorted by xxhash, index into dictionaries
+            std::vector<std::pair<std::uint64_t, std::uint32_t>> entries;
+
+            // xxhash of the reserved entry
+            static std::uint64_t xxhash() noexcept;
+
+            // Throws std::runtime_error
+            // Data of the reserved entry as stored in .wad
+            static Dictionaries read(Entry const& entry, std::span<std::byte const> data);
+
+            // Throws std::runtime_error
+            std::vector<char> write() const;
+
+            inline bool empty() const noexcept {
+                return entries.empty();
+            }
+
+            // Empty span when entry does not use a dictionary
+            std::span<std::byte const> find(std::uint64_t xxhash) const noexcept;
+        };
+
         // Throws std::runtime_error
         Wad(fs::path const& path, fs::path const& name);
         inline Wad(fs::path path) : Wad(path, path.filename()) {}
+        // Throws std::runtime_error
+        // Uses header and entries read previously instead of reading them from file
+        Wad(fs::path const& path, fs::path const& name, std::uint64_t size,
+            Header const& header, std::vector<Entry> entries);
         Wad(Wad const&) = delete;
         Wad(Wad&&) = default;
         Wad& operator=(Wad const&) = delete;
@@ -83,7 +117,24 @@ namespace LCS {
             return header_.version_minor == 0;
         }
 
-        void extract(fs::path const& dstpath, HashTable const& hashtable, Progress& progress) const;
+        // Throws std::runtime_error
+        // View of entry data inside mapping of this .wad, valid while mapping is alive
+        inline std::span<std::byte const> data(InMap const& map, Entry const& entry) const {
+            return map.span(entry.dataOffset, entry.sizeCompressed);
+        }
+
+        // Throws std::runtime_error
+        // Dictionaries stored in this .wad, views into mapping of this .wad unless they were compressed
+        Dictionaries dictionaries(InMap const& map) const;
+
+        inline bool has_dictionaries() const noexcept {
+            return has_dictionaries_;
+        }
+
+        // Throws std::runtime_error
+        // Extracts entries on up to jobs threads, 0 uses all cores
+        void extract(fs::path const& dstpath, HashTable const& hashtable, Progress& progress,
+                     std::size_t jobs = 0) const;
     private:
         fs::path path_;
         std::uint64_t size_;
@@ -92,6 +143,9 @@ namespace LCS {
         std::vector<Entry> entries_;
         std::int64_t dataBegin_ = 0;
         std::int64_t dataEnd_ = 0;
+        bool has_dictionaries_ = false;
+
+        void check_entries();
     };
 }
 
@@ -1,5 +1,8 @@
 #include "wadindex.hpp"
 #include "error.hpp"
+#include "parallel.hpp"
+#include <bit>
+#include <cstring>
 #include <utility>
 
 using namespace LCS;
@@ -18,52 +21,124 @@ static bool is_blacklisted(std::u8string filename) noexcept {
     return false;
 }
 
-WadIndex::WadIndex(fs::path const& path, bool blacklist, bool ignorebad) :
-    path_(fs::absolute(path)), blacklist_(blacklist), ignorebad_(ignorebad) {
+namespace {
+    constexpr std::array<char, 8> CACHE_MAGIC = { 'L', 'C', 'S', 'I', 'N', 'D', 'E', 'X' };
+    constexpr std::uint32_t CACHE_VERSION = 1;
+
+    struct CacheHeader {
+        std::array<char, 8> magic;
+        std::uint32_t version;
+        std::uint32_t pathSize;
+        std::uint64_t wadCount;
+    };
+
+    struct CacheWad {
+        std::uint64_t size;
+        std::int64_t last_write_time;
+        std::uint32_t state;
+        std::uint32_t pathSize;
+    };
+
+    struct CacheReader {
+        std::span<std::byte const> data;
+
+        template<typename T>
+        inline T read() {
+            T result;
+            std::memcpy(&result, read(sizeof(T)).data(), sizeof(T));
+            return result;
+        }
+
+        inline std::span<std::byte const> read(std::size_t size) {
+            lcs_assert(size <= data.size());
+            auto result = data.subspan(0, size);
+            data = data.subspan(size);
+            return result;
+        }
+    };
+
+    template<typename T>
+    inline void cache_write(std::vector<char>& buffer, T const* data, std::size_t count = 1) {
+        buffer.insert(buffer.end(), (char const*)data, (char const*)(data + count));
+    }
+}
+
+WadIndex::WadIndex(fs::path const& path, bool blacklist, bool ignorebad, fs::path const& cachepath) :
+    path_(fs::absolute(path)), cachepath_(cachepath), blacklist_(blacklist), ignorebad_(ignorebad) {
     lcs_trace_func(
                 lcs_trace_var(path.generic_u8string()),
                 lcs_trace_var(blacklist),
-                lcs_trace_var(ignorebad)
+                lcs_trace_var(ignorebad),
+                lcs_trace_var(cachepath)
                 );
-    last_write_time_ = fs::last_write_time(path_ / "DATA" / "FINAL");
+    auto cache = load_cache();
+    auto const scanned = scan();
+    auto const files = std::vector<std::pair<fs::path, WadFile>>(scanned.begin(), scanned.end());
+    auto loaded = load_wads(files, cache);
+    std::size_t cached = 0;
+    for (std::size_t index = 0; index != files.size(); index++) {
+        cached += loaded[index].from_cache;
+        insert_wad(files[index].first, std::move(loaded[index]));
+    }
+    rebuild_lookup();
+    lcs_assert_msg("Not a wad directory!", lookup_.size() != 0);
+    if (cached != files_.size() || cached != cache.size()) {
+        save_cache();
+    }
+}
+
+std::map<fs::path, WadIndex::WadFile> WadIndex::scan() const {
+    auto result = std::map<fs::path, WadFile>{};
     for (auto const& file : fs::recursive_directory_iterator(path_ / "DATA" / "FINAL")) {
         if (file.is_regular_file()) {
             if (auto wadpath = file.path(); wadpath.extension() == ".client") {
-                this->add_wad(wadpath);
+                if (blacklist_ && is_blacklisted(wadpath.filename().generic_u8string())) {
+                    continue;
+                }
+                result.insert_or_assign(wadpath.lexically_relative(path_),
+                                        WadFile { file.file_size(), file.last_write_time(), State::Skipped });
             }
         }
     }
-    lcs_assert_msg("Not a wad directory!", lookup_.size() != 0);
+    return result;
 }
 
-void WadIndex::add_wad(fs::path const& wadpath) {
+std::vector<WadIndex::LoadedWad> WadIndex::load_wads(std::vector<std::pair<fs::path, WadFile>> const& files,
+                                                    std::map<fs::path, CachedWad>& cache) const {
+    // Parse in parallel, callers insert in scan order so duplicate detection and checksums stay deterministic
+    auto loaded = std::vector<LoadedWad>(files.size());
+    parallel_for(files.size(), 0, [&] (std::size_t index) {
+        loaded[index] = load_wad(files[index].first, files[index].second, cache);
+    });
+    return loaded;
+}
+
+WadIndex::LoadedWad WadIndex::load_wad(fs::path const& relpath, WadFile file,
+                                       std::map<fs::path, CachedWad>& cache) const {
+    auto const wadpath = path_ / relpath;
     lcs_trace_func(
         lcs_trace_var(wadpath)
         );
     lcs_hint(u8"Try deleting this file: ", wadpath);
-    if (blacklist_ && is_blacklisted(wadpath.filename().generic_u8string())) {
-        return;
-    }
-    last_write_time_ = std::max(last_write_time_, fs::last_write_time(wadpath));
+    auto result = LoadedWad { file, nullptr, false };
     try {
         auto filename = wadpath.filename();
-        if (auto old = wads_.find(filename); old != wads_.end()) {
-            lcs_hint(u8"Try deleting this file: ", old->second->path());
-            throw_error("Game contains duplicated wads!");
+        if (auto c = cache.find(relpath); c != cache.end()
+                && c->second.size == file.size
+                && c->second.last_write_time == file.last_write_time
+                && (c->second.state != State::Bad || ignorebad_)) {
+            result.from_cache = true;
+            result.file.state = c->second.state;
+            if (result.file.state == State::Indexed) {
+                result.wad = std::make_unique<Wad>(wadpath, filename, file.size,
+                                                   c->second.header, std::move(c->second.entries));
+            }
         } else {
             auto wad = std::make_unique<Wad>(wadpath, filename);
-            if (wad->is_oldchecksum()) {
-                return;
-            }
-            for(auto const& entry: wad->entries()) {
-                lookup_.insert(std::make_pair(entry.xxhash, wad.get()));
-                if (auto i = checksums_.find(entry.checksum); i != checksums_.end()) {
-                    lcs_assert_msg("Inconsistent file checksum in Game folder!",  i->second == entry.checksum);
-                } else {
-                    checksums_.insert(std::make_pair(entry.xxhash, entry.checksum));
-                }
+            result.file.state = wad->is_oldchecksum() ? State::Skipped : State::Indexed;
+            if (result.file.state == State::Indexed) {
+                result.wad = std::move(wad);
             }
-            wads_.insert_or_assign(wad->name(), std::move(wad));
         }
     } catch(std::runtime_error const& err) {
         if (err.what() != std::string_view("All zero .wad") && !ignorebad_) {
@@ -71,25 +146,316 @@ void WadIndex::add_wad(fs::path const& wadpath) {
         } else {
             error_stack().clear();
             hint_stack().clear();
+            result.file.state = err.what() == std::string_view("All zero .wad") ? State::Skipped : State::Bad;
         }
     }
+    return result;
 }
 
-bool WadIndex::is_uptodate() const {
+Wad const* WadIndex::insert_wad(fs::path const& relpath, LoadedWad loaded) {
+    if (auto const& wad = loaded.wad) {
+        lcs_trace_func(
+            lcs_trace_var(wad->path())
+            );
+        lcs_hint(u8"Try deleting this file: ", wad->path());
+        if (auto old = wads_.find(wad->name()); old != wads_.end()) {
+            if (!ignorebad_) {
+                lcs_hint(u8"Try deleting this file: ", old->second->path());
+                throw_error("Game contains duplicated wads!");
+            }
+            // Same as any other bad wad, first one found stays indexed
+            loaded.file.state = State::Bad;
+            files_.insert_or_assign(relpath, loaded.file);
+            return nullptr;
+        }
+        auto const result = wad.get();
+        wads_.insert_or_assign(wad->name(), std::move(loaded.wad));
+        files_.insert_or_assign(relpath, loaded.file);
+        return result;
+    }
+    files_.insert_or_assign(relpath, loaded.file);
+    return nullptr;
+}
+
+Wad const* WadIndex::findOriginal(std::span<std::uint64_t const> xxhashes) const& noexcept {
+    if (lookup_.buckets.empty()) {
+        return nullptr;
+    }
+    thread_local std::vector<std::uint32_t> votes = {};
+    votes.assign(wadList_.size(), 0);
+    auto const& hashes = lookup_.hashes;
+    auto const& wads = lookup_.wads;
+    auto const count = hashes.size();
+    std::size_t row = 0;
+    for (auto const xxhash: xxhashes) {
+        // Jump ahead with the bucket table when the next hash is far away, walk otherwise
+        row = std::max<std::size_t>(row, lookup_.buckets[xxhash >> lookup_.shift]);
+        while (row != count && hashes[row] < xxhash) {
+            row++;
+        }
+        for (auto match = row; match != count && hashes[match] == xxhash; match++) {
+            votes[wads[match]]++;
+        }
+    }
+    auto const max = std::max_element(votes.begin(), votes.end());
+    if (max == votes.end() || *max == 0) {
+        return nullptr;
+    }
+    return wadList_[static_cast<std::size_t>(max - votes.begin())];
+}
+
+void WadIndex::remove_wad(fs::path const& relpath) {
+    auto const file = files_.find(relpath);
+    if (file == files_.end()) {
+        return;
+    }
+    if (file->second.state == State::Indexed) {
+        wads_.erase(relpath.filename());
+    }
+    files_.erase(file);
+}
+
+void WadIndex::rebuild_lookup() {
+    auto wads = std::vector<Wad const*>{};
+    for (auto const& [relpath, file]: files_) {
+        if (file.state == State::Indexed) {
+            wads.push_back(wads_.at(relpath.filename()).get());
+        }
+    }
+    lookup_ = {};
+    wadList_.clear();
+    merge_lookup({}, wads);
+}
+
+void WadIndex::merge_lookup(std::vector<std::uint32_t> const& removed, std::vector<Wad const*> const& added) {
+    // Ids follow files_ order (sorted relative path) so the first row of each xxhash comes from the first wad
+    // that has it. Wads that stay keep their relative order, their rows are still sorted once renumbered and
+    // only rows of added wads need sorting before one linear merge.
+    auto wadList = std::vector<Wad const*>{};
+    auto ids = std::unordered_map<Wad const*, std::uint32_t>{};
+    for (auto const& [relpath, file]: files_) {
+        if (file.state == State::Indexed) {
+            auto const wad = wads_.at(relpath.filename()).get();
+            ids.emplace(wad, static_cast<std::uint32_t>(wadList.size()));
+            wadList.push_back(wad);
+        }
+    }
+    // Removed ids may point at freed wads, they are never looked up
+    auto remap = std::vector<std::uint32_t>(wadList_.size(), UINT32_MAX);
+    auto gone = std::vector<bool>(wadList_.size(), false);
+    for (auto const id: removed) {
+        gone[id] = true;
+    }
+    for (std::uint32_t id = 0; id != wadList_.size(); id++) {
+        if (!gone[id]) {
+            remap[id] = ids.at(wadList_[id]);
+        }
+    }
+    struct Row {
+        std::uint64_t xxhash;
+        std::uint32_t wad;
+        std::uint64_t checksum;
+    };
+    auto rows = std::vector<Row>{};
+    for (auto const wad: added) {
+        auto const id = ids.at(wad);
+        for (auto const& entry: wad->entries()) {
+            rows.push_back({ entry.xxhash, id, entry.checksum });
+        }
+    }
+    std::sort(rows.begin(), rows.end(), [](Row const& lhs, Row const& rhs) {
+        return lhs.xxhash != rhs.xxhash ? lhs.xxhash < rhs.xxhash : lhs.wad < rhs.wad;
+    });
+
+    auto const& old = lookup_;
+    auto lookup = Lookup{};
+    lookup.hashes.reserve(old.size() + rows.size());
+    lookup.wads.reserve(old.size() + rows.size());
+    lookup.checksums.reserve(old.size() + rows.size());
+    auto const push = [&lookup] (std::uint64_t xxhash, std::uint32_t wad, std::uint64_t checksum) {
+        lookup.unique += lookup.hashes.empty() || lookup.hashes.back() != xxhash;
+        lookup.hashes.push_back(xxhash);
+        lookup.wads.push_back(wad);
+        lookup.checksums.push_back(checksum);
+    };
+    std::size_t o = 0;
+    std::size_t r = 0;
+    while (o != old.size() || r != rows.size()) {
+        if (o != old.size() && gone[old.wads[o]]) {
+            o++;
+        } else if (r == rows.size() || (o != old.size()
+                   && std::pair { old.hashes[o], remap[old.wads[o]] } < std::pair { rows[r].xxhash, rows[r].wad })) {
+            push(old.hashes[o], remap[old.wads[o]], old.checksums[o]);
+            o++;
+        } else {
+            push(rows[r].xxhash, rows[r].wad, rows[r].checksum);
+            r++;
+        }
+    }
+    lcs_assert(lookup.size() < UINT32_MAX);
+    // Roughly one row per bucket, xxhash top bits are uniform enough to not need interpolation
+    auto const bits = std::clamp<std::uint32_t>(static_cast<std::uint32_t>(std::bit_width(lookup.size())), 1, 24);
+    lookup.shift = 64 - bits;
+    lookup.buckets.resize((std::size_t{1} << bits) + 1);
+    std::size_t row = 0;
+    for (std::size_t bucket = 0; bucket != lookup.buckets.size(); bucket++) {
+        while (row != lookup.size() && (lookup.hashes[row] >> lookup.shift) < bucket) {
+            row++;
+        }
+        lookup.buckets[bucket] = static_cast<std::uint32_t>(row);
+    }
+    lookup_ = std::move(lookup);
+    wadList_ = std::move(wadList);
+}
+
+bool WadIndex::refresh() {
     lcs_trace_func(
                 lcs_trace_var(path_.generic_u8string()),
                 lcs_trace_var(blacklist_)
                 );
-    auto new_last_write_time = fs::last_write_time(path_ / "DATA" / "FINAL");
-    for (auto const& file : fs::recursive_directory_iterator(path_ / "DATA" / "FINAL")) {
-        if (file.is_regular_file()) {
-            if (auto filepath = file.path(); filepath.extension() == ".client") {
-                if (blacklist_ && is_blacklisted(filepath.filename().generic_u8string())) {
-                    continue;
-                }
-                new_last_write_time = std::max(new_last_write_time, fs::last_write_time(filepath));
+    auto const current = scan();
+    auto changed = std::vector<fs::path>{};
+    for (auto const& [relpath, file]: files_) {
+        if (auto i = current.find(relpath); i == current.end()
+                || i->second.size != file.size
+                || i->second.last_write_time != file.last_write_time) {
+            changed.push_back(relpath);
+        }
+    }
+    auto added = std::vector<std::pair<fs::path, WadFile>>{};
+    for (auto const& [relpath, file]: current) {
+        if (auto i = files_.find(relpath); i == files_.end()
+                || i->second.size != file.size
+                || i->second.last_write_time != file.last_write_time) {
+            added.emplace_back(relpath, file);
+        }
+    }
+    if (changed.empty() && added.empty()) {
+        return false;
+    }
+    // Half patched wads fail here while index is still untouched
+    auto cache = std::map<fs::path, CachedWad>{};
+    auto loaded = load_wads(added, cache);
+    // Only rows of removed and added wads change, everything else is merged over from current lookup
+    auto removed = std::vector<std::uint32_t>{};
+    for (auto const& relpath: changed) {
+        if (files_.at(relpath).state == State::Indexed) {
+            auto const wad = wads_.at(relpath.filename()).get();
+            auto const id = std::find(wadList_.begin(), wadList_.end(), wad) - wadList_.begin();
+            removed.push_back(static_cast<std::uint32_t>(id));
+        }
+    }
+    try {
+        for (auto const& relpath: changed) {
+            remove_wad(relpath);
+        }
+        auto inserted = std::vector<Wad const*>{};
+        for (std::size_t index = 0; index != added.size(); index++) {
+            if (auto const wad = insert_wad(added[index].first, std::move(loaded[index]))) {
+                inserted.push_back(wad);
             }
-         }
+        }
+        merge_lookup(removed, inserted);
+    } catch (...) {
+        // Removed wads are already freed, lookup must not keep pointing at them
+        lookup_ = {};
+        wadList_.clear();
+        rebuild_lookup();
+        throw;
+    }
+    save_cache();
+    return true;
+}
+
+std::map<fs::path, WadIndex::CachedWad> WadIndex::load_cache() const noexcept {
+    auto result = std::map<fs::path, CachedWad>{};
+    if (cachepath_.empty() || !fs::exists(cachepath_)) {
+        return result;
+    }
+    try {
+        auto const map = InMap(cachepath_);
+        auto reader = CacheReader { map.span(0, map.size()) };
+        auto const header = reader.read<CacheHeader>();
+        lcs_assert(header.magic == CACHE_MAGIC && header.version == CACHE_VERSION);
+        auto const gamepath = reader.read(header.pathSize);
+        lcs_assert(path_.generic_u8string() == std::u8string_view((char8_t const*)gamepath.data(), gamepath.size()));
+        for (std::uint64_t i = 0; i != header.wadCount; i++) {
+            auto const record = reader.read<CacheWad>();
+            auto const relpath = reader.read(record.pathSize);
+            lcs_assert(record.state <= (std::uint32_t)State::Bad);
+            auto cached = CachedWad {};
+            cached.size = record.size;
+            cached.last_write_time = fs::file_time_type(fs::file_time_type::duration(record.last_write_time));
+            cached.state = (State)record.state;
+            if (cached.state == State::Indexed) {
+                cached.header = reader.read<Wad::Header>();
+                auto const entries = reader.read(cached.header.filecount * sizeof(Wad::Entry));
+                cached.entries.resize(cached.header.filecount);
+                std::memcpy(cached.entries.data(), entries.data(), entries.size());
+            }
+            result.insert_or_assign(std::u8string((char8_t const*)relpath.data(), relpath.size()), std::move(cached));
+        }
+        lcs_assert(reader.data.empty());
+    } catch (std::runtime_error const&) {
+        error_stack().clear();
+        hint_stack().clear();
+        result.clear();
+    }
+    return result;
+}
+
+void WadIndex::save_cache() const noexcept {
+    if (cachepath_.empty()) {
+        return;
     }
-    return new_last_write_time == last_write_time_;
+    try {
+        auto buffer = std::vector<char>{};
+        auto const gamepath = path_.generic_u8string();
+        auto const header = CacheHeader {
+            CACHE_MAGIC,
+            CACHE_VERSION,
+            static_cast<std::uint32_t>(gamepath.size()),
+            static_cast<std::uint64_t>(files_.size()),
+        };
+        cache_write(buffer, &header);
+        cache_write(buffer, gamepath.data(), gamepath.size());
+        for (auto const& [relpath, file]: files_) {
+            auto const relpath_str = relpath.generic_u8string();
+            auto const record = CacheWad {
+                file.size,
+                static_cast<std::int64_t>(file.last_write_time.time_since_epoch().count()),
+                static_cast<std::uint32_t>(file.state),
+                static_cast<std::uint32_t>(relpath_str.size()),
+            };
+            cache_write(buffer, &record);
+            cache_write(buffer, relpath_str.data(), relpath_str.size());
+            if (file.state == State::Indexed) {
+                auto const& wad = wads_.at(relpath.filename());
+                cache_write(buffer, &wad->header());
+                cache_write(buffer, wad->entries().data(), wad->entries().size());
+            }
+        }
+        if (cachepath_.has_parent_path()) {
+            fs::create_directories(cachepath_.parent_path());
+        }
+        auto outfile = OutFile(cachepath_);
+        outfile.write(buffer.data(), buffer.size());
+    } catch (std::exception const&) {
+        error_stack().clear();
+        hint_stack().clear();
+    }
+}
+
+bool WadIndex::is_uptodate() const {
+    lcs_trace_func(
+                lcs_trace_var(path_.generic_u8string()),
+                lcs_trace_var(blacklist_)
+                );
+    auto const current = scan();
+    return std::equal(current.begin(), current.end(), files_.begin(), files_.end(),
+                      [](auto const& lhs, auto const& rhs) {
+        return lhs.first == rhs.first
+                && lhs.second.size == rhs.second.size
+                && lhs.second.last_write_time == rhs.second.last_write_time;
+    });
 }
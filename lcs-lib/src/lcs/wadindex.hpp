@@ -3,24 +3,67 @@
 #include "common.hpp"
 #include "wad.hpp"
 #include <map>
+#include <optional>
+#include <ranges>
+#include <span>
 #include <unordered_map>
 #include <vector>
 #include <algorithm>
 
 namespace LCS{
     struct WadIndex {
-        template<typename iter_t>
-        struct EntryRange {
-            iter_t const beg_;
-            iter_t const end_;
-            inline auto begin() const noexcept { return beg_; }
-            inline auto end() const noexcept { return end_; }
-            inline auto cbegin() const noexcept { return beg_; }
-            inline auto cend() const noexcept { return end_; }
+        // Flat index with one row per (xxhash, wad) pair, sorted by xxhash then by wad id
+        // buckets[i] is the first row whose xxhash starts with top bits i
+        struct Lookup {
+            std::vector<std::uint64_t> hashes;
+            std::vector<std::uint32_t> wads;
+            std::vector<std::uint64_t> checksums;
+            std::vector<std::uint32_t> buckets;
+            std::uint32_t shift = 63;
+            std::size_t unique = 0;
+
+            inline std::size_t size() const noexcept {
+                return hashes.size();
+            }
+
+            inline std::pair<std::size_t, std::size_t> equal_range(std::uint64_t hash) const noexcept {
+                if (buckets.empty()) {
+                    return { 0, 0 };
+                }
+                auto const bucket = hash >> shift;
+                auto const beg = hashes.begin() + buckets[bucket];
+                auto const end = hashes.begin() + buckets[bucket + 1];
+                auto const first = std::lower_bound(beg, end, hash);
+                auto const last = std::upper_bound(first, end, hash);
+                return { first - hashes.begin(), last - hashes.begin() };
+            }
+        };
+
+        // Checksum of each known xxhash as found in the first wad that contains it
+        struct Checksums {
+            Lookup const& lookup_;
+
+            inline std::size_t size() const noexcept {
+                return lookup_.unique;
+            }
+
+            inline bool contains(std::uint64_t xxhash) const noexcept {
+                auto const [first, last] = lookup_.equal_range(xxhash);
+                return first != last;
+            }
+
+            inline std::optional<std::uint64_t> find(std::uint64_t xxhash) const noexcept {
+                if (auto const [first, last] = lookup_.equal_range(xxhash); first != last) {
+                    return lookup_.checksums[first];
+                }
+                return std::nullopt;
+            }
         };
 
         // Throws std::runtime_error
-        WadIndex(fs::path const& path, bool blacklist = true, bool ignorebad = false);
+        // Wads whose size and modification time match their record in cachepath are not parsed again
+        WadIndex(fs::path const& path, bool blacklist = true, bool ignorebad = false,
+                 fs::path const& cachepath = {});
         WadIndex(WadIndex const&) = delete;
         WadIndex(WadIndex&&) = default;
         WadIndex& operator=(WadIndex const&) = delete;
@@ -28,6 +71,10 @@ namespace LCS{
 
         bool is_uptodate() const;
 
+        // Throws std::runtime_error
+        // Re-reads only wads that were added, removed or modified, returns true if anything changed
+        bool refresh();
+
         inline auto const& path() const& noexcept {
             return path_;
         }
@@ -40,37 +87,31 @@ namespace LCS{
             return lookup_;
         }
 
-        inline auto const& checksums() const& noexcept {
-            return checksums_;
+        inline auto checksums() const& noexcept {
+            return Checksums { lookup_ };
         }
 
+        // Wads that contain given xxhash
         inline auto findExtra(uint64_t hash) const& noexcept {
-            auto [beg, end] = lookup_.equal_range(hash);
-            return EntryRange<decltype(beg)> { beg, end };
+            auto const [first, last] = lookup_.equal_range(hash);
+            return std::span(lookup_.wads).subspan(first, last - first)
+                    | std::views::transform([this] (std::uint32_t id) { return wadList_[id]; });
         }
 
+        // Wad that contains most of given xxhashes, xxhashes must be sorted
+        Wad const* findOriginal(std::span<std::uint64_t const> xxhashes) const& noexcept;
+
         template<typename I, typename F>
         inline Wad const* findOriginal(I const& collection, F&& func) const& noexcept {
-            std::unordered_map<Wad const*, size_t> counter{};
-            counter.reserve(wads_.size());
-            for(auto const& [name, wad]: wads_) {
-                counter[wad.get()] = 0;
-            }
+            thread_local std::vector<std::uint64_t> xxhashes = {};
+            xxhashes.clear();
             for(auto const& entry: collection) {
-                auto xxhash = func(entry);
-                auto wads = lookup_.equal_range(xxhash);
-                for(auto w = wads.first; w != wads.second; ++w) {
-                    counter[w->second] += 1;
-                }
+                xxhashes.push_back(func(entry));
             }
-            auto const max = std::max_element(counter.cbegin(), counter.cend(),
-                                              [](auto const& l, auto const& r) {
-               return l.second < r.second;
-            });
-            if (max->second == 0) {
-                return nullptr;
+            if (!std::is_sorted(xxhashes.begin(), xxhashes.end())) {
+                std::sort(xxhashes.begin(), xxhashes.end());
             }
-            return max->first;
+            return findOriginal(std::span<std::uint64_t const>(xxhashes));
         }
 
         inline auto findOriginal(fs::path const& filename, std::vector<Wad::Entry> const& entries) const& noexcept {
@@ -102,15 +143,48 @@ namespace LCS{
             });
         }
     private:
+        enum class State : std::uint32_t {
+            Indexed,
+            Skipped,
+            Bad,
+        };
+        struct WadFile {
+            std::uint64_t size;
+            fs::file_time_type last_write_time;
+            State state;
+        };
+        struct CachedWad : WadFile {
+            Wad::Header header;
+            std::vector<Wad::Entry> entries;
+        };
+        struct LoadedWad {
+            WadFile file;
+            std::unique_ptr<Wad const> wad;
+            bool from_cache;
+        };
+
         fs::path path_;
+        fs::path cachepath_;
         std::map<fs::path, std::unique_ptr<Wad const>> wads_;
-        std::unordered_multimap<uint64_t, Wad const*> lookup_;
-        std::unordered_map<uint64_t, uint64_t> checksums_;
+        std::map<fs::path, WadFile> files_;
+        std::vector<Wad const*> wadList_;
+        Lookup lookup_;
         bool blacklist_;
         bool ignorebad_;
-        fs::file_time_type last_write_time_ = {};
 
-        void add_wad(fs::path const& wadpath);
+        std::map<fs::path, WadFile> scan() const;
+        std::vector<LoadedWad> load_wads(std::vector<std::pair<fs::path, WadFile>> const& files,
+                                         std::map<fs::path, CachedWad>& cache) const;
+        LoadedWad load_wad(fs::path const& relpath, WadFile file, std::map<fs::path, CachedWad>& cache) const;
+        // Throws std::runtime_error
+        // Inserted wad, null when there was nothing to index
+        Wad const* insert_wad(fs::path const& relpath, LoadedWad loaded);
+        void remove_wad(fs::path const& relpath);
+        void rebuild_lookup();
+        // Drops rows of removed ids and merges in rows of added wads, files_ and wads_ must already be updated
+        void merge_lookup(std::vector<std::uint32_t> const& removed, std::vector<Wad const*> const& added);
+        std::map<fs::path, CachedWad> load_cache() const noexcept;
+        void save_cache() const noexcept;
     };
 }
 
@@ -1,9 +1,18 @@
 #include "wadmake.hpp"
+#include "decoder.hpp"
+#include "encoder.hpp"
 #include "error.hpp"
+#include "parallel.hpp"
 #include "progress.hpp"
 #include "utility.hpp"
+#include "wadmakecache.hpp"
 #include <charconv>
+#include <condition_variable>
+#include <cstring>
+#include <map>
+#include <mutex>
 #include <numeric>
+#include <tuple>
 #include <xxhash.h>
 #include <picosha2.hpp>
 #include <zstd.h>
@@ -13,6 +22,37 @@
 using namespace LCS;
 
 inline constexpr auto GB = static_cast<std::uint64_t>(1024 * 1024 * 1024);
+// ZSTD_WINDOWLOG_MIN and ZSTD_WINDOWLOG_LIMIT_DEFAULT, decoders refuse larger windows by default
+inline constexpr int WINDOWLOG_MIN = 10;
+inline constexpr int WINDOWLOG_MAX = 27;
+
+WadMakeOptions WadMakeOptions::fast() noexcept {
+    auto result = WadMakeOptions {};
+    result.level = 1;
+    return result;
+}
+
+WadMakeOptions WadMakeOptions::max() noexcept {
+    auto result = WadMakeOptions {};
+    result.level = ZSTD_maxCLevel();
+    result.windowLog = WINDOWLOG_MAX;
+    result.longDistance = true;
+    return result;
+}
+
+void WadMakeOptions::check() const {
+    lcs_trace_func(
+                lcs_trace_var(level),
+                lcs_trace_var(windowLog)
+                );
+    lcs_assert_msg("Bad zstd level!", level >= ZSTD_minCLevel() && level <= ZSTD_maxCLevel());
+    lcs_assert_msg("Bad zstd window log!", windowLog == 0
+                   || (windowLog >= WINDOWLOG_MIN && windowLog <= WINDOWLOG_MAX));
+    lcs_assert_msg("Bad dictionary size!", dictionaryEntryMax == 0 || dictionarySize != 0);
+    for (auto const& [extension, policy]: extensions) {
+        lcs_assert_msg("Bad zstd level!", policy.level >= ZSTD_minCLevel() && policy.level <= ZSTD_maxCLevel());
+    }
+}
 
 WadMakeBase::~WadMakeBase() noexcept {
 
@@ -52,15 +92,22 @@ WadMakeCopy::WadMakeCopy(fs::path const& path, WadIndex const* index, bool remov
     auto wad = Wad(path_);
     entries_ = wad.entries();
     is_oldchecksum_ = wad.is_oldchecksum();
+    std::erase_if(entries_, [this] (auto const& entry) -> bool {
+        if (entry.xxhash == Wad::Dictionaries::xxhash()) {
+            dictionaries_ = entry;
+            return true;
+        }
+        return false;
+    });
     if (removeUnknownNames) {
-        std::erase_if(entries_, [&checksums = index->checksums()] (auto const& entry) -> bool {
+        std::erase_if(entries_, [checksums = index->checksums()] (auto const& entry) -> bool {
             return !checksums.contains(entry.xxhash);
         });
     }
     for (auto const& entry: entries_) {
         size_ += entry.sizeCompressed;
     }
-    can_copy_ = !is_oldchecksum_ && (entries_.size() == wad.entries().size());
+    can_copy_ = !is_oldchecksum_ && !dictionaries_ && (entries_.size() == wad.entries().size());
 }
 
 void WadMakeCopy::write(fs::path const& dstpath, Progress& progress) const {
@@ -76,24 +123,38 @@ void WadMakeCopy::write(fs::path const& dstpath, Progress& progress) const {
         return;
     }
     OutFile outfile(dstpath);
-    std::vector<char> buffer;
     std::vector<Wad::Entry> entries = {};
     entries.reserve(entries_.size());
     std::uint32_t dataOffset = sizeof(Wad::Header) + entries_.size() * sizeof(Wad::Entry);
-    InFile infile(path_);
+    InMap const map(path_);
+    auto infile = InFile(path_);
+    auto const dictionaries = dictionaries_ ? Wad::Dictionaries::read(
+        *dictionaries_, map.span(dictionaries_->dataOffset, dictionaries_->sizeCompressed)) : Wad::Dictionaries{};
+    std::vector<char> uncompressed;
+    std::vector<char> recompressed;
     outfile.seek(dataOffset, SEEK_SET);
     for(auto entry: entries_) {
-        buffer.reserve(entry.sizeCompressed);
-        infile.seek(entry.dataOffset, SEEK_SET);
-        infile.read(buffer.data(), entry.sizeCompressed);
-        if (entry.type != Wad::Entry::Type::FileRedirection) {
-            if (is_oldchecksum_) {
-                entry.checksum = XXH3_64bits(buffer.data(), entry.sizeCompressed);
+        auto data = map.span(entry.dataOffset, entry.sizeCompressed);
+        if (auto const dictionary = dictionaries.find(entry.xxhash); !dictionary.empty()) {
+            // Game can not decode dictionary frames, store them as plain zstd
+            uncompressed.resize(entry.sizeUncompressed);
+            Decoder::local().zstd(uncompressed.data(), uncompressed.size(), data.data(), data.size(),
+                                  dictionary.data(), dictionary.size());
+            recompressed.resize(Encoder::zstd_bound(uncompressed.size()));
+            recompressed.resize(Encoder::local().zstd(recompressed.data(), recompressed.size(),
+                                                      uncompressed.data(), uncompressed.size(), 0));
+            data = std::as_bytes(std::span(recompressed));
+            entry.sizeCompressed = (uint32_t)data.size();
+            entry.checksum = XXH3_64bits(data.data(), data.size());
+            outfile.write(data.data(), data.size());
+        } else {
+            if (is_oldchecksum_ && entry.type != Wad::Entry::Type::FileRedirection) {
+                entry.checksum = XXH3_64bits(data.data(), data.size());
             }
+            outfile.copy(infile, entry.dataOffset, entry.sizeCompressed);
         }
         entry.dataOffset = dataOffset;
         dataOffset += entry.sizeCompressed;
-        outfile.write(buffer.data(), entry.sizeCompressed);
         entries.push_back(entry);
         progress.consumeData(entry.sizeCompressed);
     }
@@ -114,31 +175,402 @@ void WadMakeCopy::write(fs::path const& dstpath, Progress& progress) const {
 }
 
 /// Makes a .wad from folder on a filesystem
-WadMake::WadMake(fs::path const& path, WadIndex const* index, bool removeUnknownNames)
+WadMake::WadMake(fs::path const& path, WadIndex const* index, bool removeUnknownNames,
+                 WadMakeOptions const& options)
     : path_(fs::absolute(path)),
       name_(path_.filename()),
-      index_(index) {
+      index_(index),
+      options_(options) {
     lcs_trace_func(
                 lcs_trace_var(path),
                 lcs_trace_var(removeUnknownNames)
                 );
     lcs_assert(fs::is_directory(path_));
+    options_.check();
     if (removeUnknownNames) {
         lcs_assert(index);
     }
-    for(auto const& entry: fs::recursive_directory_iterator(path_)) {
-        if(entry.is_regular_file()) {
-            auto xxhash = pathhash(fs::relative(entry.path(), path_));
+    auto roots = std::vector<fs::directory_entry>{};
+    for (auto const& entry: fs::directory_iterator(path_)) {
+        roots.push_back(entry);
+    }
+    // Each root is walked in order and merged back in order so later duplicates win same as a single walk
+    auto found = std::vector<std::vector<std::pair<std::uint64_t, Source>>>(roots.size());
+    parallel_for(roots.size(), 0, [&] (std::size_t root) {
+        auto const add = [&] (fs::directory_entry const& entry) {
+            if (!entry.is_regular_file()) {
+                return;
+            }
+            // Entries come from under path_ so there is nothing for fs::relative to resolve
+            auto xxhash = pathhash(entry.path().lexically_relative(path_));
             if (removeUnknownNames && !index->checksums().contains(xxhash)) {
-                continue;
+                return;
+            }
+            found[root].emplace_back(xxhash, Source { entry.path(), entry.file_size(), entry.last_write_time() });
+        };
+        add(roots[root]);
+        if (roots[root].is_directory() && !roots[root].is_symlink()) {
+            for (auto const& entry: fs::recursive_directory_iterator(roots[root].path())) {
+                add(entry);
             }
-            entries_.insert_or_assign(xxhash, entry.path());
+        }
+    });
+    for (auto& sources: found) {
+        for (auto& [xxhash, source]: sources) {
+            entries_.insert_or_assign(xxhash, std::move(source));
         }
     }
     size_ = 0;
-    for (auto const& kvp: entries_) {
-        size_ += fs::file_size(kvp.second);
+    for (auto const& [xxhash, source]: entries_) {
+        size_ += source.size;
+    }
+}
+
+namespace {
+    struct PackedEntry {
+        Wad::Entry entry;
+        std::vector<char> data;
+        // View into the cache used instead of data
+        std::span<std::byte const> cached;
+        // Set when entry can go into the cache
+        std::optional<WadMakeCache::Record> record;
+        // Left for the writer to pack straight from source
+        bool streamed = false;
+    };
+
+    // Streamed sources are read this much at a time
+    constexpr std::size_t STREAM_CHUNK = 1024 * 1024;
+
+    // Bytes of sources read but not yet written, their compressed copies can add about as much again
+    constexpr std::uint64_t WINDOW_BYTES = 256 * 1024 * 1024;
+
+    // Sources bigger than twice the sample are trial compressed before the real pass
+    constexpr std::size_t INCOMPRESSIBLE_SAMPLE = 64 * 1024;
+
+    // Dictionaries for one write, ids are indices into contents
+    struct PackDictionaries {
+        std::vector<std::vector<char>> contents;
+        std::vector<std::unique_ptr<EncoderDictionary>> encoders;
+        // Dictionary id of each source or -1
+        std::vector<std::int32_t> sources;
+    };
+
+    // Fewer samples than this are not worth a dictionary
+    constexpr std::size_t DICTIONARY_MIN_SAMPLES = 8;
+
+    // Groups below this many dictionary sizes would end up copied whole into their dictionary
+    constexpr std::size_t DICTIONARY_MIN_RATIO = 2;
+}
+
+// Index of first source with same content as each source, only sources that share a size get hashed
+static std::vector<std::size_t> find_duplicates(
+        std::vector<std::pair<std::uint64_t const, WadMake::Source> const*> const& sources, bool deduplicate) {
+    auto result = std::vector<std::size_t>(sources.size());
+    std::iota(result.begin(), result.end(), std::size_t{0});
+    if (!deduplicate) {
+        return result;
+    }
+    auto sizes = std::vector<std::pair<std::uint64_t, std::size_t>>(sources.size());
+    for (std::size_t index = 0; index != sources.size(); index++) {
+        sizes[index] = { sources[index]->second.size, index };
+    }
+    std::sort(sizes.begin(), sizes.end());
+    auto candidates = std::vector<std::pair<std::uint64_t, std::size_t>>{};
+    for (std::size_t i = 0; i != sizes.size(); i++) {
+        if ((i != 0 && sizes[i - 1].first == sizes[i].first)
+                || (i + 1 != sizes.size() && sizes[i + 1].first == sizes[i].first)) {
+            candidates.push_back(sizes[i]);
+        }
+    }
+    auto hashes = std::vector<XXH128_hash_t>(candidates.size());
+    parallel_for(candidates.size(), 0, [&] (std::size_t i) {
+        auto const map = InMap(sources[candidates[i].second]->second.path);
+        hashes[i] = XXH3_128bits(map.data(), map.size());
+    });
+    // Candidates are ordered by index within each size so the first source of each content wins
+    auto first = std::map<std::tuple<std::uint64_t, std::uint64_t, std::uint64_t>, std::size_t>{};
+    for (std::size_t i = 0; i != candidates.size(); i++) {
+        auto const [size, index] = candidates[i];
+        auto const key = std::tuple { size, hashes[i].low64, hashes[i].high64 };
+        result[index] = first.try_emplace(key, index).first->second;
     }
+    return result;
+}
+
+static std::u8string entry_extension(fs::path const& path, std::span<char const> data) {
+    std::u8string extension = path.extension().generic_u8string();
+    if (extension.empty()) {
+        extension = u8"." + ScanExtension(data.data(), data.size());
+    }
+    return extension;
+}
+
+// Bytes saved by packing members with dictionary instead of plain zstd, counting the compressed dictionary itself
+static std::int64_t dictionary_gain(std::vector<std::span<char const>> const& members, std::span<char const> content,
+                                    EncoderDictionary const& dictionary, WadMakeOptions::Policy const& policy,
+                                    WadMakeOptions const& options) {
+    auto const compressed_size = [&] (std::span<char const> data, EncoderDictionary const* with) {
+        auto buffer = std::vector<char>(Encoder::zstd_bound(data.size()));
+        return static_cast<std::int64_t>(Encoder::local().zstd(buffer.data(), buffer.size(), data.data(), data.size(),
+                                                               policy.level, options.windowLog, options.longDistance,
+                                                               with));
+    };
+    auto gains = std::vector<std::int64_t>(members.size());
+    parallel_for(members.size(), 0, [&] (std::size_t i) {
+        auto const data = members[i];
+        gains[i] = compressed_size(data, nullptr) - compressed_size(data, &dictionary);
+    });
+    return std::accumulate(gains.begin(), gains.end(), std::int64_t{0}) - compressed_size(content, nullptr);
+}
+
+// Groups small sources by extension and builds one raw content dictionary from evenly spaced samples of each group.
+// Dictionaries that do not pay for themselves are dropped and their group is packed as plain zstd.
+static PackDictionaries build_dictionaries(std::vector<std::pair<std::uint64_t const, WadMake::Source> const*> const& sources,
+                                           std::vector<std::size_t> const& duplicates,
+                                           WadMakeOptions const& options) {
+    auto result = PackDictionaries {};
+    result.sources.assign(sources.size(), -1);
+    if (options.dictionaryEntryMax == 0) {
+        return result;
+    }
+    auto samples = std::vector<std::pair<std::u8string, std::vector<char>>>(sources.size());
+    parallel_for(sources.size(), 0, [&] (std::size_t index) {
+        auto const& source = sources[index]->second;
+        if (duplicates[index] != index) {
+            return;
+        }
+        if (source.size == 0 || source.size > options.dictionaryEntryMax) {
+            return;
+        }
+        InFile infile(source.path);
+        auto& [extension, data] = samples[index];
+        data.resize((std::size_t)source.size);
+        infile.read(data.data(), data.size());
+        extension = entry_extension(source.path, data);
+        if (options.policy(extension).store) {
+            extension.clear();
+        }
+    });
+    auto groups = std::map<std::u8string, std::vector<std::size_t>>{};
+    for (std::size_t index = 0; index != samples.size(); index++) {
+        if (auto const& extension = samples[index].first; !extension.empty()) {
+            groups[extension].push_back(index);
+        }
+    }
+    for (auto const& [extension, members]: groups) {
+        if (members.size() < DICTIONARY_MIN_SAMPLES) {
+            continue;
+        }
+        std::size_t total = 0;
+        for (auto const index: members) {
+            total += samples[index].second.size();
+        }
+        if (total < std::size_t{options.dictionarySize} * DICTIONARY_MIN_RATIO) {
+            continue;
+        }
+        auto const step = (total + options.dictionarySize - 1) / options.dictionarySize;
+        auto content = std::vector<char>{};
+        for (std::size_t i = 0; i < members.size(); i += step) {
+            auto const& data = samples[members[i]].second;
+            if (content.size() + data.size() > options.dictionarySize) {
+                break;
+            }
+            content.insert(content.end(), data.begin(), data.end());
+        }
+        auto const policy = options.policy(extension);
+        auto encoder = std::make_unique<EncoderDictionary>(content.data(), content.size(), policy.level);
+        auto data = std::vector<std::span<char const>>{};
+        for (auto const index: members) {
+            data.push_back(samples[index].second);
+        }
+        if (dictionary_gain(data, content, *encoder, policy, options) <= 0) {
+            continue;
+        }
+        auto const id = static_cast<std::int32_t>(result.contents.size());
+        result.encoders.push_back(std::move(encoder));
+        result.contents.push_back(std::move(content));
+        for (auto const index: members) {
+            result.sources[index] = id;
+        }
+    }
+    return result;
+}
+
+// Everything besides level that changes compressed bytes of cached entries
+static std::uint64_t cache_settings(WadMakeOptions const& options) noexcept {
+    std::int64_t const settings[] = {
+        ZSTD_versionNumber(), options.windowLog, options.longDistance, options.storeIncompressible,
+    };
+    return XXH64(settings, sizeof(settings), 0);
+}
+
+// What cache keeps about a source, hash is filled in once its content is read
+static WadMakeCache::Source cache_source(WadMake::Source const& source) noexcept {
+    return { source.size, static_cast<std::int64_t>(source.last_write_time.time_since_epoch().count()), {} };
+}
+
+// Entry from cache when source is unchanged and would be packed the same way now
+static std::optional<PackedEntry> cached_entry(std::uint64_t xxhash, WadMake::Source const& source,
+                                               WadMakeOptions const& options, WadMakeCache const& cache) {
+    auto const record = cache.find(xxhash, source.path, cache_source(source));
+    if (!record) {
+        return std::nullopt;
+    }
+    auto const policy = options.policy(std::u8string(record->extension_view()));
+    if (record->store != policy.store || (!policy.store && record->level != policy.level)) {
+        return std::nullopt;
+    }
+    auto result = PackedEntry { record->entry, {}, cache.data(*record), record, false };
+    result.entry.dataOffset = 0;
+    return result;
+}
+
+// Fastest level trial of slices spread over data, true when they do not even shrink by 1/64th.
+// Catches embedded ogg, png and other already compressed payloads without a full compression pass.
+static bool looks_incompressible(std::span<char const> data) {
+    if (data.size() <= INCOMPRESSIBLE_SAMPLE * 2) {
+        return false;
+    }
+    constexpr std::size_t SLICES = 4;
+    constexpr std::size_t SLICE = INCOMPRESSIBLE_SAMPLE / SLICES;
+    char sample[INCOMPRESSIBLE_SAMPLE];
+    for (std::size_t i = 0; i != SLICES; i++) {
+        std::memcpy(sample + i * SLICE, data.data() + (data.size() - SLICE) / (SLICES - 1) * i, SLICE);
+    }
+    auto buffer = std::vector<char>(Encoder::zstd_bound(sizeof(sample)));
+    auto const size = Encoder::local().zstd(buffer.data(), buffer.size(), sample, sizeof(sample), 1);
+    return size >= sizeof(sample) - sizeof(sample) / 64;
+}
+
+// Reads and compresses one source file, dataOffset is left for the writer to fill in
+static PackedEntry pack_entry(std::uint64_t xxhash, WadMake::Source const& source, WadMakeOptions const& options,
+                              EncoderDictionary const* dictionary, bool cacheable, std::vector<char>& inbuffer) {
+    lcs_trace_func(
+                lcs_trace_var(source.path)
+                );
+    // Size comes from the scan, a source that shrank since then fails to read
+    InFile infile(source.path);
+    std::uint64_t uncompressedSize = source.size;
+    lcs_assert(uncompressedSize < 2 * GB);
+    auto result = PackedEntry {
+        {
+            xxhash,
+            {},
+            {},
+            (uint32_t)uncompressedSize,
+            {},
+            false,
+            {},
+            {}
+        },
+        {},
+        {},
+        std::nullopt,
+        false,
+    };
+    inbuffer.clear();
+    inbuffer.resize((size_t)uncompressedSize);
+    infile.read(inbuffer.data(), inbuffer.size());
+    auto const extension = entry_extension(source.path, inbuffer);
+    auto const policy = options.policy(extension);
+    if (cacheable && extension.size() <= WadMakeCache::Record{}.extension.size()) {
+        auto const hash = XXH3_128bits(inbuffer.data(), inbuffer.size());
+        result.record = WadMakeCache::Record {
+            {},
+            cache_source(source),
+            policy.store ? 0 : policy.level,
+            static_cast<std::uint16_t>(extension.size()),
+            policy.store,
+            {},
+            {},
+        };
+        result.record->source.hash = { hash.low64, hash.high64 };
+        std::copy(extension.begin(), extension.end(), result.record->extension.begin());
+    }
+    auto store = policy.store || (options.storeIncompressible && looks_incompressible(inbuffer));
+    if (!store) {
+        result.entry.type = Wad::Entry::ZStandardCompressed;
+        result.data.resize(Encoder::zstd_bound(inbuffer.size()));
+        auto const size = Encoder::local().zstd(result.data.data(), result.data.size(),
+                                                inbuffer.data(), inbuffer.size(),
+                                                policy.level, options.windowLog, options.longDistance,
+                                                dictionary);
+        result.data.resize(size);
+        store = options.storeIncompressible && size >= inbuffer.size();
+    }
+    if (store) {
+        result.entry.type = Wad::Entry::Uncompressed;
+        result.data = std::move(inbuffer);
+    }
+    result.entry.checksum = XXH3_64bits(result.data.data(), result.data.size());
+    result.entry.sizeCompressed = (uint32_t)result.data.size();
+    if (result.record) {
+        result.record->entry = result.entry;
+    }
+    return result;
+}
+
+// Packs one source straight into outfile with fixed size buffers, dataOffset is left for the caller
+static Wad::Entry stream_entry(std::uint64_t xxhash, WadMake::Source const& source, WadMakeOptions const& options,
+                               OutFile& outfile) {
+    lcs_trace_func(
+                lcs_trace_var(source.path)
+                );
+    InFile infile(source.path);
+    std::uint64_t uncompressedSize = source.size;
+    lcs_assert(uncompressedSize < 2 * GB);
+    auto buffer = std::vector<char>((std::size_t)std::min<std::uint64_t>(uncompressedSize, STREAM_CHUNK));
+    infile.read(buffer.data(), buffer.size());
+    infile.seek(0, SEEK_SET);
+    auto const policy = options.policy(entry_extension(source.path, buffer));
+    auto state = std::unique_ptr<XXH3_state_t, decltype(&XXH3_freeState)>(XXH3_createState(), &XXH3_freeState);
+    lcs_assert(state && XXH3_64bits_reset(state.get()) == XXH_OK);
+    auto const read = [&] (void* data, std::size_t size) {
+        infile.read(data, size);
+    };
+    auto const write = [&] (void const* data, std::size_t size) {
+        outfile.write(data, size);
+        XXH3_64bits_update(state.get(), data, size);
+    };
+    auto result = Wad::Entry {
+        xxhash,
+        {},
+        {},
+        (uint32_t)uncompressedSize,
+        {},
+        false,
+        {},
+        {}
+    };
+    auto const store = [&] {
+        result.type = Wad::Entry::Uncompressed;
+        for (auto remaining = uncompressedSize; remaining != 0; remaining -= buffer.size()) {
+            buffer.resize((std::size_t)std::min<std::uint64_t>(remaining, STREAM_CHUNK));
+            read(buffer.data(), buffer.size());
+            write(buffer.data(), buffer.size());
+        }
+        return uncompressedSize;
+    };
+    std::uint64_t compressedSize = 0;
+    if (policy.store || (options.storeIncompressible && looks_incompressible(buffer))) {
+        compressedSize = store();
+    } else {
+        auto const start = outfile.tell();
+        result.type = Wad::Entry::ZStandardCompressed;
+        compressedSize = Encoder::local().zstd_stream(uncompressedSize, policy.level,
+                                                      options.windowLog, options.longDistance, read, write);
+        if (options.storeIncompressible && compressedSize >= uncompressedSize) {
+            // Same fallback as pack_entry, raw copy goes over the frame and the writer trims what is left past it
+            outfile.seek(start, SEEK_SET);
+            infile.seek(0, SEEK_SET);
+            lcs_assert(XXH3_64bits_reset(state.get()) == XXH_OK);
+            compressedSize = store();
+        }
+    }
+    lcs_assert(compressedSize < 2 * GB);
+    result.sizeCompressed = (uint32_t)compressedSize;
+    result.checksum = XXH3_64bits_digest(state.get());
+    return result;
 }
 
 void WadMake::write(fs::path const& dstpath, Progress& progress) const {
@@ -148,53 +580,158 @@ void WadMake::write(fs::path const& dstpath, Progress& progress) const {
     progress.startItem(dstpath, size_);
     fs::create_directories(dstpath.parent_path());
     OutFile outfile(dstpath);
-    std::vector<Wad::Entry> entries;
-    entries.reserve(entries_.size());
-    std::vector<char> inbuffer;
-    std::vector<char> outbuffer;
-    uint64_t dataOffset = sizeof(Wad::Header) + sizeof(Wad::Entry) * entries_.size();
+    auto sources = std::vector<std::pair<std::uint64_t const, WadMake::Source> const*>{};
+    sources.reserve(entries_.size());
+    for (auto const& kvp: entries_) {
+        sources.push_back(&kvp);
+    }
+    auto const duplicates = find_duplicates(sources, options_.deduplicate);
+    auto const dictionaries = build_dictionaries(sources, duplicates, options_);
+    // Entries packed with a dictionary depend on other sources and are never cached
+    auto cache = std::optional<WadMakeCache>{};
+    auto cacheWriter = std::optional<WadMakeCache::Writer>{};
+    if (!options_.cache.empty()) {
+        cache.emplace(options_.cache, path_, cache_settings(options_));
+        cacheWriter.emplace(options_.cache, path_, cache_settings(options_));
+    }
+    std::vector<Wad::Entry> entries(sources.size());
+    uint64_t dataOffset = sizeof(Wad::Header)
+            + sizeof(Wad::Entry) * (entries.size() + !dictionaries.contents.empty());
     outfile.seek(dataOffset, SEEK_SET);
-    for(auto const& [xxhash, path]: entries_) {
-        InFile infile(path);
-        std::uint64_t uncompressedSize = infile.size();
-        lcs_assert(uncompressedSize < 2 * GB);
-        Wad::Entry entry = {
-            xxhash,
+
+    // Workers read and compress entries in any order, whichever worker completes the next entry in hash order
+    // becomes the writer and flushes every completed entry from there, so output never depends on scheduling.
+    // Workers stay at most window entries and WINDOW_BYTES of buffered sources ahead of the writer to bound memory,
+    // next entry to write is always let through so a source bigger than the budget still gets packed.
+    auto const window = default_jobs() * 4;
+    auto const buffered_size = [&] (std::size_t index) -> std::uint64_t {
+        auto const size = sources[index]->second.size;
+        auto const streamed = options_.streamEntryMin != 0 && size >= options_.streamEntryMin;
+        return duplicates[index] != index || streamed ? 0 : size;
+    };
+    std::uint64_t buffered = 0;
+    auto packed = std::vector<std::optional<PackedEntry>>(sources.size());
+    std::mutex mutex;
+    std::condition_variable written_changed;
+    std::size_t written = 0;
+    bool writing = false;
+    bool failed = false;
+    parallel_for(sources.size(), 0, [] {
+        return std::vector<char>{};
+    }, [&] (std::vector<char>& inbuffer, std::size_t index) {
+        try {
+            {
+                auto lock = std::unique_lock(mutex);
+                written_changed.wait(lock, [&] {
+                    return failed || index == written
+                            || (index < written + window && buffered + buffered_size(index) <= WINDOW_BYTES);
+                });
+                if (failed) {
+                    return;
+                }
+                buffered += buffered_size(index);
+            }
+            auto result = PackedEntry {};
+            if (duplicates[index] == index) {
+                auto const& [xxhash, source] = *sources[index];
+                auto const dictionary = dictionaries.sources[index] < 0
+                        ? nullptr : dictionaries.encoders[dictionaries.sources[index]].get();
+                if (auto hit = cache && !dictionary ? cached_entry(xxhash, source, options_, *cache) : std::nullopt) {
+                    result = std::move(*hit);
+                } else if (options_.streamEntryMin != 0 && source.size >= options_.streamEntryMin) {
+                    result.entry.xxhash = xxhash;
+                    result.streamed = true;
+                } else {
+                    result = pack_entry(xxhash, source, options_, dictionary, cache && !dictionary, inbuffer);
+                    // Keeping big buffers per thread would add up outside of the window
+                    if (inbuffer.capacity() > STREAM_CHUNK) {
+                        inbuffer = {};
+                    }
+                }
+            }
+            auto lock = std::unique_lock(mutex);
+            packed[index] = std::move(result);
+            if (writing) {
+                return;
+            }
+            writing = true;
+            while (written != packed.size() && packed[written]) {
+                auto const current = written;
+                auto item = std::move(*packed[current]);
+                packed[current].reset();
+                lock.unlock();
+                if (auto const original = duplicates[current]; original != current) {
+                    // Same layout WadMerge uses for shared data
+                    item.entry = entries[original];
+                    item.entry.xxhash = sources[current]->first;
+                    item.entry.isDuplicate = true;
+                } else if (item.streamed) {
+                    item.entry = stream_entry(item.entry.xxhash, sources[current]->second, options_, outfile);
+                    item.entry.dataOffset = static_cast<uint32_t>(dataOffset);
+                    dataOffset += item.entry.sizeCompressed;
+                    lcs_assert(dataOffset <= 2 * GB);
+                } else {
+                    auto const data = item.cached.data() ? item.cached : std::as_bytes(std::span(item.data));
+                    item.entry.dataOffset = static_cast<uint32_t>(dataOffset);
+                    outfile.write(data.data(), data.size());
+                    dataOffset += item.entry.sizeCompressed;
+                    lcs_assert(dataOffset <= 2 * GB);
+                    if (item.record) {
+                        cacheWriter->add(*item.record, data.data());
+                    }
+                }
+                entries[current] = item.entry;
+                progress.consumeData(item.entry.sizeUncompressed);
+                lock.lock();
+                buffered -= buffered_size(current);
+                written = current + 1;
+                written_changed.notify_all();
+            }
+            writing = false;
+        } catch (...) {
+            auto lock = std::lock_guard(mutex);
+            failed = true;
+            written_changed.notify_all();
+            throw;
+        }
+    });
+    if (!dictionaries.contents.empty()) {
+        auto stored = Wad::Dictionaries {};
+        for (auto const& content: dictionaries.contents) {
+            stored.dictionaries.push_back(std::as_bytes(std::span(content)));
+        }
+        for (std::size_t index = 0; index != sources.size(); index++) {
+            // Entries that ended up stored raw do not need their dictionary
+            auto const id = dictionaries.sources[duplicates[index]];
+            if (id >= 0 && entries[index].type == Wad::Entry::ZStandardCompressed) {
+                stored.entries.emplace_back(sources[index]->first, id);
+            }
+        }
+        lcs_assert(!entries_.contains(Wad::Dictionaries::xxhash()));
+        auto const raw = stored.write();
+        auto data = std::vector<char>(Encoder::zstd_bound(raw.size()));
+        data.resize(Encoder::local().zstd(data.data(), data.size(), raw.data(), raw.size(), options_.level));
+        auto type = Wad::Entry::ZStandardCompressed;
+        if (data.size() >= raw.size()) {
+            type = Wad::Entry::Uncompressed;
+            data = raw;
+        }
+        entries.push_back({
+            Wad::Dictionaries::xxhash(),
             static_cast<uint32_t>(dataOffset),
-            {},
-            (uint32_t)uncompressedSize,
-            {},
+            (uint32_t)data.size(),
+            (uint32_t)raw.size(),
+            type,
             false,
             {},
-            {}
-        };
-        inbuffer.clear();
-        inbuffer.resize((size_t)uncompressedSize);
-        infile.read(inbuffer.data(), inbuffer.size());
-        std::u8string extension = path.extension().generic_u8string();
-        if (extension.empty()) {
-            extension = u8"." + ScanExtension(inbuffer.data(), inbuffer.size());
-        }
-        if (extension == u8".wpk" || extension == u8".bnk") {
-            entry.type = Wad::Entry::Uncompressed;
-            outbuffer = inbuffer;
-        } else {
-            entry.type = Wad::Entry::ZStandardCompressed;
-            outbuffer.clear();
-            outbuffer.resize(ZSTD_compressBound(inbuffer.size()));
-            size_t zstd_out_size = ZSTD_compress(outbuffer.data(), outbuffer.size(),
-                                                 inbuffer.data(), inbuffer.size(), 0);
-            lcs_assert(!ZSTD_isError(zstd_out_size));
-            outbuffer.resize(zstd_out_size);
-        }
-        entry.checksum = XXH3_64bits(outbuffer.data(), outbuffer.size());
-        outfile.write(outbuffer.data(), outbuffer.size());
-        entry.sizeCompressed = (uint32_t)outbuffer.size();
-        entry.dataOffset = static_cast<uint32_t>(dataOffset);
-        dataOffset += entry.sizeCompressed;
+            XXH3_64bits(data.data(), data.size()),
+        });
+        outfile.write(data.data(), data.size());
+        dataOffset += data.size();
         lcs_assert(dataOffset <= 2 * GB);
-        entries.push_back(entry);
-        progress.consumeData(uncompressedSize);
+        std::sort(entries.begin(), entries.end(), [](auto const& lhs, auto const& rhs) {
+            return lhs.xxhash < rhs.xxhash;
+        });
     }
     outfile.seek(0, SEEK_SET);
     Wad::Header header{
@@ -207,5 +744,12 @@ void WadMake::write(fs::path const& dstpath, Progress& progress) const {
     };
     outfile.write((char const*)&header, sizeof(Wad::Header));
     outfile.write((char const*)entries.data(), sizeof(Wad::Entry) * entries.size());
+    // Streamed entries that were stored raw after all can leave part of their zstd frame behind
+    outfile.resize(dataOffset);
+    if (cacheWriter) {
+        // Old cache is still mapped until here
+        cache.reset();
+        cacheWriter->finish();
+    }
     progress.finishItem();
 }
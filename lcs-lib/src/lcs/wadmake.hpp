@@ -8,6 +8,55 @@
 #include <map>
 
 namespace LCS {
+    struct WadMakeOptions {
+        // How entries with one extension are packed, level is ignored for stored entries
+        struct Policy {
+            bool store = false;
+            int level = 0;
+        };
+
+        // zstd level, 0 is zstd default
+        int level = 0;
+        // zstd window log, 0 lets zstd pick, anything above 27 would not decode in game
+        int windowLog = 0;
+        bool longDistance = false;
+        // Entries up to this size share a raw content dictionary with entries of same extension, 0 disables.
+        // Only lcs reads wads made this way, WadMakeCopy writes them back as plain zstd before they reach the game.
+        std::uint32_t dictionaryEntryMax = 0;
+        std::uint32_t dictionarySize = 112 * 1024;
+        // Byte identical files are packed once and shared through isDuplicate entries
+        bool deduplicate = true;
+        // Compressed entries are kept here and reused by the next write when their source did not change, empty disables.
+        // One file per source folder, WadMakeQueue appends a hash of each source folder path to it.
+        fs::path cache;
+        // Entries from this size are compressed by the writer in fixed size chunks straight into output, 0 disables.
+        // Keeps memory flat for huge sources at the cost of packing them one at a time, they are never cached.
+        std::uint32_t streamEntryMin = 64 * 1024 * 1024;
+        // Entries zstd can not shrink are stored raw, big ones are judged early by trial compressing a sample
+        bool storeIncompressible = true;
+        // Keyed by extension with the dot, entries without one use their scanned extension
+        std::map<std::u8string, Policy> extensions = {
+            { u8".wpk", { true, 0 } },
+            { u8".bnk", { true, 0 } },
+        };
+
+        // Quickest packing for iteration
+        static WadMakeOptions fast() noexcept;
+
+        // Smallest output for distribution
+        static WadMakeOptions max() noexcept;
+
+        // Throws std::runtime_error
+        void check() const;
+
+        inline Policy policy(std::u8string const& extension) const noexcept {
+            if (auto i = extensions.find(extension); i != extensions.end()) {
+                return i->second;
+            }
+            return { false, level };
+        }
+    };
+
     struct WadMakeBase {
         virtual ~WadMakeBase() noexcept = 0;
         virtual void write(fs::path const& path, Progress& progress) const = 0;
@@ -51,11 +100,22 @@ namespace LCS {
         std::vector<Wad::Entry> entries_;
         std::uint64_t size_ = 0;
         bool is_oldchecksum_ = false;
+        std::optional<Wad::Entry> dictionaries_;
         bool can_copy_ = false;
     };
 
     struct WadMake : WadMakeBase {
-        WadMake(fs::path const& path, WadIndex const* index, bool removeUnknownNames);
+        // Recorded once while scanning and handed to the writer
+        struct Source {
+            fs::path path;
+            std::uint64_t size;
+            fs::file_time_type last_write_time;
+        };
+
+        // Throws std::runtime_error
+        // Top level folders are scanned in parallel
+        WadMake(fs::path const& path, WadIndex const* index, bool removeUnknownNames,
+                WadMakeOptions const& options = {});
 
         void write(fs::path const& dstpath, Progress& progress) const override;
 
@@ -85,8 +145,9 @@ namespace LCS {
         fs::path path_;
         fs::path name_;
         WadIndex const* index_;
-        std::map<uint64_t, fs::path> entries_;
+        std::map<uint64_t, Source> entries_;
         std::uint64_t size_ = 0;
+        WadMakeOptions options_;
     };
 }
 
@@ -0,0 +1,145 @@
+#include "wadmakecache.hpp"
+#include "error.hpp"
+#include <algorithm>
+#include <charconv>
+#include <cstring>
+#include <xxhash.h>
+
+using namespace LCS;
+
+namespace {
+    constexpr std::array<char, 8> CACHE_MAGIC = { 'L', 'C', 'S', 'M', 'K', 'C', 'C', 'H' };
+    constexpr std::uint32_t CACHE_VERSION = 3;
+
+    struct CacheHeader {
+        std::array<char, 8> magic;
+        std::uint32_t version;
+        std::uint32_t recordCount;
+        std::uint64_t settings;
+        std::uint64_t root;
+        std::uint64_t recordsOffset;
+    };
+
+    // Records are keyed by relative path, a cache written for another folder must never match
+    std::uint64_t root_hash(fs::path const& root) {
+        auto const name = fs::canonical(root).generic_u8string();
+        return XXH64(name.data(), name.size(), 0);
+    }
+}
+
+WadMakeCache::Writer::Writer(fs::path const& path, fs::path const& root, std::uint64_t settings)
+    : path_(path), temp_(fs::path(path) += ".tmp"), settings_(settings), root_(root_hash(root)),
+      dataOffset_(sizeof(CacheHeader)) {
+    lcs_trace_func(
+                lcs_trace_var(path),
+                lcs_trace_var(root)
+                );
+    if (path_.has_parent_path()) {
+        fs::create_directories(path_.parent_path());
+    }
+    outfile_ = std::make_unique<OutFile>(temp_);
+    outfile_->seek(dataOffset_, SEEK_SET);
+}
+
+void WadMakeCache::Writer::add(Record record, void const* data) {
+    lcs_assert(records_.empty() || records_.back().entry.xxhash < record.entry.xxhash);
+    lcs_assert(dataOffset_ + record.entry.sizeCompressed < UINT32_MAX);
+    record.entry.dataOffset = static_cast<std::uint32_t>(dataOffset_);
+    record.entry.isDuplicate = false;
+    outfile_->write(data, record.entry.sizeCompressed);
+    records_.push_back(record);
+    dataOffset_ += record.entry.sizeCompressed;
+}
+
+void WadMakeCache::Writer::finish() {
+    lcs_trace_func(
+                lcs_trace_var(path_)
+                );
+    auto const header = CacheHeader {
+        CACHE_MAGIC,
+        CACHE_VERSION,
+        static_cast<std::uint32_t>(records_.size()),
+        settings_,
+        root_,
+        dataOffset_,
+    };
+    outfile_->write(records_.data(), records_.size() * sizeof(Record));
+    outfile_->seek(0, SEEK_SET);
+    outfile_->write(&header, sizeof(header));
+    outfile_.reset();
+    fs::rename(temp_, path_);
+}
+
+fs::path WadMakeCache::root_path(fs::path const& base, fs::path const& root) {
+    char hex[16];
+    auto const result = std::to_chars(hex, hex + sizeof(hex), root_hash(root), 16);
+    auto name = std::string(hex, result.ptr);
+    name.insert(name.begin(), sizeof(hex) - name.size(), '0');
+    return fs::path(base) += "." + name;
+}
+
+WadMakeCache::WadMakeCache(fs::path const& path, fs::path const& root, std::uint64_t settings) {
+    lcs_trace_func(
+                lcs_trace_var(path),
+                lcs_trace_var(root)
+                );
+    if (!fs::exists(path)) {
+        return;
+    }
+    auto const rootHash = root_hash(root);
+    // Broken or outdated cache only costs a full repack
+    try {
+        auto map = std::make_unique<InMap const>(path);
+        CacheHeader header;
+        std::memcpy(&header, map->span(0, sizeof(header)).data(), sizeof(header));
+        if (header.magic != CACHE_MAGIC || header.version != CACHE_VERSION || header.settings != settings
+                || header.root != rootHash) {
+            return;
+        }
+        auto const records = map->span(header.recordsOffset, std::uint64_t{header.recordCount} * sizeof(Record));
+        lcs_assert(header.recordsOffset + records.size() == map->size());
+        records_.resize(header.recordCount);
+        std::memcpy(records_.data(), records.data(), records.size());
+        for (std::size_t i = 0; i != records_.size(); i++) {
+            lcs_assert(i == 0 || records_[i - 1].entry.xxhash < records_[i].entry.xxhash);
+            lcs_assert(records_[i].extensionSize <= records_[i].extension.size());
+            lcs_assert(std::uint64_t{records_[i].entry.dataOffset} + records_[i].entry.sizeCompressed
+                       <= header.recordsOffset);
+        }
+        map_ = std::move(map);
+    } catch (std::runtime_error const&) {
+        error_stack().clear();
+        hint_stack().clear();
+        records_.clear();
+    }
+}
+
+WadMakeCache::~WadMakeCache() noexcept {}
+
+std::optional<WadMakeCache::Record> WadMakeCache::find(std::uint64_t xxhash, fs::path const& path,
+                                                       Source const& source) const {
+    auto const i = std::lower_bound(records_.begin(), records_.end(), xxhash, [](auto const& record, std::uint64_t value) {
+        return record.entry.xxhash < value;
+    });
+    if (i == records_.end() || i->entry.xxhash != xxhash) {
+        return std::nullopt;
+    }
+    if (source.size != i->source.size) {
+        return std::nullopt;
+    }
+    if (source.mtime != i->source.mtime) {
+        // Touched but maybe not changed, for example by a checkout
+        auto const map = InMap(path);
+        auto const hash = XXH3_128bits(map.data(), map.size());
+        if (hash.low64 != i->source.hash[0] || hash.high64 != i->source.hash[1]) {
+            return std::nullopt;
+        }
+    }
+    auto result = *i;
+    result.source.mtime = source.mtime;
+    return result;
+}
+
+std::span<std::byte const> WadMakeCache::data(Record const& record) const {
+    return map_->span(record.entry.dataOffset, record.entry.sizeCompressed);
+}
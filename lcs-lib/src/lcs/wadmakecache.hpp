@@ -0,0 +1,88 @@
+#ifndef LCS_WADMAKECACHE_HPP
+#define LCS_WADMAKECACHE_HPP
+#include "common.hpp"
+#include "iofile.hpp"
+#include "wad.hpp"
+#include <array>
+#include <memory>
+#include <optional>
+#include <span>
+#include <string_view>
+#include <vector>
+
+namespace LCS {
+    // Compressed entries kept from a previous WadMake::write so unchanged sources can be spliced back in
+    struct WadMakeCache {
+        // What a source file looked like when it was packed
+        struct Source {
+            std::uint64_t size;
+            std::int64_t mtime;
+            std::array<std::uint64_t, 2> hash;
+        };
+
+        struct Record {
+            // dataOffset points into the cache file
+            Wad::Entry entry;
+            Source source;
+            std::int32_t level;
+            std::uint16_t extensionSize;
+            // Policy said store, entries zstd could not shrink are stored without it
+            bool store;
+            std::uint8_t pad;
+            std::array<char8_t, 16> extension;
+
+            inline std::u8string_view extension_view() const noexcept {
+                return { extension.data(), extensionSize };
+            }
+        };
+        static_assert(sizeof(Record) == 88);
+
+        // Writes a new cache next to path and swaps it in on finish
+        struct Writer {
+            // Throws std::runtime_error
+            // Root is the source folder records are relative to
+            Writer(fs::path const& path, fs::path const& root, std::uint64_t settings);
+
+            // Throws std::runtime_error
+            // Records must come in xxhash order
+            void add(Record record, void const* data);
+
+            // Throws std::runtime_error
+            void finish();
+        private:
+            fs::path path_;
+            fs::path temp_;
+            std::uint64_t settings_;
+            std::uint64_t root_;
+            std::unique_ptr<OutFile> outfile_;
+            std::vector<Record> records_;
+            std::uint64_t dataOffset_;
+        };
+
+        // Throws std::runtime_error
+        // Cache of one root when several roots share base, named after the canonical root
+        static fs::path root_path(fs::path const& base, fs::path const& root);
+
+        // Throws std::runtime_error
+        // Missing cache or one written for another root or with other settings is empty
+        WadMakeCache(fs::path const& path, fs::path const& root, std::uint64_t settings);
+        WadMakeCache(WadMakeCache const&) = delete;
+        WadMakeCache(WadMakeCache&&) = delete;
+        WadMakeCache& operator=(WadMakeCache const&) = delete;
+        WadMakeCache& operator=(WadMakeCache&&) = delete;
+        ~WadMakeCache() noexcept;
+
+        // Throws std::runtime_error
+        // Record of xxhash when path still has the same content, path is only hashed when its mtime changed.
+        // Size and mtime are what the caller saw for path, hash of source is ignored.
+        std::optional<Record> find(std::uint64_t xxhash, fs::path const& path, Source const& source) const;
+
+        // Throws std::runtime_error
+        std::span<std::byte const> data(Record const& record) const;
+    private:
+        std::unique_ptr<InMap const> map_;
+        std::vector<Record> records_;
+    };
+}
+
+#endif // LCS_WADMAKECACHE_HPP
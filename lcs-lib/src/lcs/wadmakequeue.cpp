@@ -2,13 +2,15 @@
 #include "error.hpp"
 #include "progress.hpp"
 #include "conflict.hpp"
+#include "wadmakecache.hpp"
 #include <numeric>
 
 using namespace LCS;
 
-WadMakeQueue::WadMakeQueue(WadIndex const& index, bool removeUnknownNames)
+WadMakeQueue::WadMakeQueue(WadIndex const& index, bool removeUnknownNames, WadMakeOptions const& options)
     : index_(index),
-      remove_unknown_names_(removeUnknownNames)
+      remove_unknown_names_(removeUnknownNames),
+      options_(options)
 {}
 
 void WadMakeQueue::addItem(fs::path const& srcpath, Conflict conflict) {
@@ -16,7 +18,12 @@ void WadMakeQueue::addItem(fs::path const& srcpath, Conflict conflict) {
                 lcs_trace_var(srcpath)
                 );
     if (fs::is_directory(srcpath)) {
-        addItemWad(std::make_unique<WadMake>(srcpath, &index_, remove_unknown_names_), conflict);
+        auto options = options_;
+        if (!options.cache.empty()) {
+            // Cache belongs to one source folder, sharing it would have every item throw away the previous one
+            options.cache = WadMakeCache::root_path(options.cache, srcpath);
+        }
+        addItemWad(std::make_unique<WadMake>(srcpath, &index_, remove_unknown_names_, options), conflict);
     } else {
         addItemWad(std::make_unique<WadMakeCopy>(srcpath, &index_, remove_unknown_names_), conflict);
     }
@@ -8,7 +8,7 @@
 
 namespace LCS {
     struct WadMakeQueue {
-        WadMakeQueue(WadIndex const& index, bool removeUnknownNames);
+        WadMakeQueue(WadIndex const& index, bool removeUnknownNames, WadMakeOptions const& options = {});
 
         void addItem(fs::path const& srcpath, Conflict conflict);
 
@@ -29,6 +29,7 @@ namespace LCS {
         mutable std::uint64_t size_ = 0;
         mutable bool sizeCalculated_ = false;
         bool remove_unknown_names_ = false;
+        WadMakeOptions options_;
 
         void addItemWad(std::unique_ptr<WadMakeBase> item, Conflict conflict);
     };
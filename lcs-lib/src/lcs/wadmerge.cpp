@@ -2,7 +2,10 @@
 #include "error.hpp"
 #include "progress.hpp"
 #include "conflict.hpp"
+#include <algorithm>
+#include <functional>
 #include <numeric>
+#include <optional>
 #include <utility>
 #include <unordered_set>
 #include <picosha2.hpp>
@@ -10,6 +13,32 @@
 
 using namespace LCS;
 
+namespace {
+    // Source spans that touch are written with one copy
+    struct Run {
+        Wad const* wad;
+        std::uint64_t srcOffset;
+        std::uint64_t dstOffset;
+        std::uint64_t size;
+    };
+
+    // Runs at least this big keep their offset within a block, costs under a block of padding each
+    constexpr std::uint64_t ALIGN_BLOCK = File::CLONE_BLOCK;
+    constexpr std::uint64_t ALIGN_RUN_MIN = 16 * ALIGN_BLOCK;
+}
+
+// Entries of wad sorted by xxhash, duplicate hashes keep their order
+static std::vector<Wad::Entry> sorted_entries(Wad const* wad) {
+    auto result = wad->entries();
+    auto const by_xxhash = [] (auto const& lhs, auto const& rhs) {
+        return lhs.xxhash < rhs.xxhash;
+    };
+    if (!std::is_sorted(result.begin(), result.end(), by_xxhash)) {
+        std::stable_sort(result.begin(), result.end(), by_xxhash);
+    }
+    return result;
+}
+
 WadMerge::WadMerge(fs::path const& path, Wad const* original)
  : path_(fs::absolute(path)), original_(original) {
     lcs_trace_func(
@@ -18,10 +47,17 @@ WadMerge::WadMerge(fs::path const& path, Wad const* original)
                 );
     lcs_assert_msg("Using league installation with 3.0 wads!", !original->is_oldchecksum());
     fs::create_directories(path_.parent_path());
-    // TODO: potentially optimize by using the fact entries are sorted
-    for(auto const& entry: original->entries()) {
-        entries_.insert_or_assign(entry.xxhash, Entry { entry, original, EntryKind::Original });
-        orgchecksum_.insert_or_assign(entry.xxhash, entry.checksum);
+    auto const entries = sorted_entries(original);
+    entries_.reserve(entries.size());
+    orgchecksum_.reserve(entries.size());
+    for(auto const& entry: entries) {
+        // Later duplicates win same as they would on insertion
+        if (!entries_.empty() && entries_.back().xxhash == entry.xxhash) {
+            entries_.pop_back();
+            orgchecksum_.pop_back();
+        }
+        entries_.push_back(Entry { entry, original, EntryKind::Original });
+        orgchecksum_.emplace_back(entry.xxhash, entry.checksum);
     }
 }
 
@@ -30,9 +66,30 @@ void WadMerge::addWad(const Wad* source, Conflict conflict) {
                 lcs_trace_var(source->path())
                 );
     lcs_assert_msg("Mods using 3.0 wads need to be re-installed!", !source->is_oldchecksum());
-    for(auto const& entry: source->entries()) {
-        addWadEntry(entry, source, conflict, EntryKind::Full);
+    // Linear merge of two sorted tables, each source entry still sees the one before it with same xxhash
+    auto merged = std::vector<Entry>{};
+    merged.reserve(entries_.size() + source->entries().size());
+    auto i = entries_.begin();
+    for(auto const& entry: sorted_entries(source)) {
+        while (i != entries_.end() && i->xxhash < entry.xxhash) {
+            merged.push_back(*i++);
+        }
+        if (i != entries_.end() && i->xxhash == entry.xxhash) {
+            merged.push_back(*i++);
+        }
+        auto const current = !merged.empty() && merged.back().xxhash == entry.xxhash ? &merged.back() : nullptr;
+        if (!accept(current, entry, source, conflict)) {
+            continue;
+        }
+        if (current) {
+            *current = Entry { entry, source, EntryKind::Full };
+        } else {
+            merged.push_back(Entry { entry, source, EntryKind::Full });
+        }
+        sizeCalculated_ = false;
     }
+    merged.insert(merged.end(), i, entries_.end());
+    entries_ = std::move(merged);
 }
 
 void WadMerge::addExtraEntry(const Wad::Entry& entry, const Wad* source, Conflict conflict) {
@@ -40,35 +97,44 @@ void WadMerge::addExtraEntry(const Wad::Entry& entry, const Wad* source, Conflic
                 lcs_trace_var(source->path())
                 );
     lcs_assert_msg("Mods using 3.0 wads need to be re-installed!", !source->is_oldchecksum());
-    addWadEntry(entry, source, conflict, EntryKind::Extra);
+    // Extra entries are found through the original so they nearly always replace in place
+    auto i = std::lower_bound(entries_.begin(), entries_.end(), entry.xxhash, [] (auto const& lhs, auto rhs) {
+        return lhs.xxhash < rhs;
+    });
+    auto const current = i != entries_.end() && i->xxhash == entry.xxhash ? &*i : nullptr;
+    if (!accept(current, entry, source, conflict)) {
+        return;
+    }
+    if (current) {
+        *current = Entry { entry, source, EntryKind::Extra };
+    } else {
+        entries_.insert(i, Entry { entry, source, EntryKind::Extra });
+    }
+    sizeCalculated_ = false;
 }
 
-void WadMerge::addWadEntry(Wad::Entry const& entry, Wad const* source,
-                           Conflict conflict, EntryKind kind) {
-    if (auto o = orgchecksum_.find(entry.xxhash); o != orgchecksum_.end() && o->second == entry.checksum) {
-        return;
+bool WadMerge::accept(Entry const* current, Wad::Entry const& entry, Wad const* source, Conflict conflict) const {
+    auto o = std::lower_bound(orgchecksum_.begin(), orgchecksum_.end(), entry.xxhash, [] (auto const& lhs, auto rhs) {
+        return lhs.first < rhs;
+    });
+    if (o != orgchecksum_.end() && o->first == entry.xxhash && o->second == entry.checksum) {
+        return false;
     }
-    if (auto i = entries_.find(entry.xxhash); i != entries_.end()) {
-        if (i->second.checksum != entry.checksum && i->second.kind_ != EntryKind::Original) {
-            if (conflict == Conflict::Skip) {
-                return;
-            } else if(conflict == Conflict::Abort) {
-                raise_hash_conflict(entry.xxhash, i->second.wad_->path(), source->path());
-            }
+    if (current && current->checksum != entry.checksum && current->kind_ != EntryKind::Original) {
+        if (conflict == Conflict::Skip) {
+            return false;
+        } else if(conflict == Conflict::Abort) {
+            raise_hash_conflict(entry.xxhash, current->wad_->path(), source->path());
         }
-        i->second = Entry { entry, source, kind };
-        sizeCalculated_ = false;
-    } else {
-        entries_.insert(i, std::pair {entry.xxhash, Entry { entry, source, kind } });
-        sizeCalculated_ = false;
     }
+    return true;
 }
 
 std::uint64_t WadMerge::size() const noexcept {
     if(!sizeCalculated_) {
         size_ = std::accumulate(entries_.begin(), entries_.end(), std::uint64_t{0},
-                    [](std::uint64_t old, auto const& kvp) -> std::uint64_t {
-            return old + kvp.second.sizeCompressed;
+                    [](std::uint64_t old, auto const& entry) -> std::uint64_t {
+            return old + entry.sizeCompressed;
         });
         sizeCalculated_ = true;
     }
@@ -81,33 +147,69 @@ void WadMerge::write(Progress& progress) const {
                 );
     auto const totalSize = size();
     progress.startItem(path_, totalSize);
-    auto wadMap = std::map<Wad const*, std::map<uint32_t, std::map<uint64_t, Wad::Entry const*>>> {};
     auto newHeader = original_->header();
     auto newEntries = std::vector<Wad::Entry> {};
+    auto runs = std::vector<Run> {};
     {
-        for (auto const& [xxhash, entry]: entries_) {
-            wadMap[entry.wad_][entry.dataOffset][entry.xxhash] = &entry;
+        // Source order, entries sharing data in one wad end up next to each other with lowest xxhash first
+        auto layout = std::vector<Entry const*>{};
+        layout.reserve(entries_.size());
+        for (auto const& entry: entries_) {
+            layout.push_back(&entry);
+        }
+        std::sort(layout.begin(), layout.end(), [] (Entry const* lhs, Entry const* rhs) {
+            if (lhs->wad_ != rhs->wad_) {
+                return std::less<Wad const*>{}(lhs->wad_, rhs->wad_);
+            }
+            return std::pair { lhs->dataOffset, lhs->xxhash } < std::pair { rhs->dataOffset, rhs->xxhash };
+        });
+        // Entries get their offset inside a run of touching source spans first, runs are placed after
+        auto entryRuns = std::vector<std::size_t>{};
+        entryRuns.reserve(layout.size());
+        newEntries.reserve(layout.size());
+        for (auto i = layout.begin(); i != layout.end(); i++) {
+            auto const& entry = **i;
+            auto const shared = i != layout.begin()
+                    && (*std::prev(i))->wad_ == entry.wad_ && (*std::prev(i))->dataOffset == entry.dataOffset;
+            if (shared) {
+                // Same layout as WadMake uses for duplicates
+                auto newEntry = newEntries.back();
+                newEntry.xxhash = entry.xxhash;
+                newEntry.isDuplicate = true;
+                newEntries.push_back(newEntry);
+                entryRuns.push_back(entryRuns.back());
+                continue;
+            }
+            if (runs.empty() || runs.back().wad != entry.wad_
+                    || runs.back().srcOffset + runs.back().size != entry.dataOffset) {
+                runs.push_back({ entry.wad_, entry.dataOffset, 0, 0 });
+            }
+            newEntries.push_back({
+                entry.xxhash,
+                static_cast<std::uint32_t>(runs.back().size),
+                entry.sizeCompressed,
+                entry.sizeUncompressed,
+                entry.type,
+                false,
+                {},
+                entry.checksum,
+            });
+            entryRuns.push_back(runs.size() - 1);
+            runs.back().size += entry.sizeCompressed;
         }
         auto dataOffset = (std::uint64_t)(sizeof(Wad::Header) + entries_.size() * sizeof(Wad::Entry));
-        for (auto const& [wad, offsetMap]: wadMap) {
-            for (auto const& [offset, xxhashMap]: offsetMap) {
-                Wad::Entry newEntry = {};
-                for (auto const& [xxhash, entry]: xxhashMap) {
-                    newEntry.xxhash = entry->xxhash;
-                    if (!newEntry.isDuplicate) {
-                        newEntry.dataOffset = dataOffset;
-                        newEntry.sizeCompressed = entry->sizeCompressed;
-                        newEntry.sizeUncompressed = entry->sizeUncompressed;
-                        newEntry.type = entry->type;
-                        newEntry.checksum = entry->checksum;
-                    }
-                    newEntries.push_back(newEntry);
-                    newEntry.isDuplicate = true;
-                }
-                dataOffset += newEntry.sizeCompressed;
-                constexpr auto GB = static_cast<std::uint64_t>(1024 * 1024 * 1024);
-                lcs_assert(dataOffset <= 2 * GB);
+        for (auto& run: runs) {
+            if (run.size >= ALIGN_RUN_MIN) {
+                // Same position within a block as in source, lets copy on write filesystems share the blocks
+                dataOffset += (run.srcOffset - dataOffset) % ALIGN_BLOCK;
             }
+            run.dstOffset = dataOffset;
+            dataOffset += run.size;
+            constexpr auto GB = static_cast<std::uint64_t>(1024 * 1024 * 1024);
+            lcs_assert(dataOffset <= 2 * GB);
+        }
+        for (std::size_t i = 0; i != newEntries.size(); i++) {
+            newEntries[i].dataOffset += static_cast<std::uint32_t>(runs[entryRuns[i]].dstOffset);
         }
         lcs_trace_func(
                     lcs_trace_var(entries_.size()),
@@ -142,24 +244,18 @@ void WadMerge::write(Progress& progress) const {
     auto outfile = OutFile(path_);
     outfile.write((char const*)&newHeader, sizeof(Wad::Header));
     outfile.write((char const*)newEntries.data(), newEntries.size() * sizeof(Wad::Entry));
-    char buffer[64 * 1024] = {};
-    for (auto const& [wad, offsetMap]: wadMap) {
-        InFile infile(wad->path());
-        std::int64_t currentOffset = 0;
-        for (auto const& [offset, xxhashMap]: offsetMap) {
-            auto const size = xxhashMap.begin()->second->sizeCompressed;
-            if (offset > currentOffset) {
-                infile.seek(offset - currentOffset, SEEK_CUR);
-            }
-            currentOffset = offset + size;
-            for (std::size_t remain = size; remain; ) {
-                std::size_t n = std::min(sizeof(buffer), remain);
-                infile.read(buffer, n);
-                outfile.write(buffer, n);
-                remain -= n;
-            }
-            progress.consumeData(size);
+    auto infile = std::optional<InFile>{};
+    for (auto i = runs.begin(); i != runs.end(); i++) {
+        if (i == runs.begin() || std::prev(i)->wad != i->wad) {
+            infile.reset();
+            infile.emplace(i->wad->path());
+        }
+        if (auto const position = (std::uint64_t)outfile.tell(); position != i->dstOffset) {
+            char const zeros[ALIGN_BLOCK] = {};
+            outfile.write(zeros, i->dstOffset - position);
         }
+        outfile.copy(*infile, i->srcOffset, i->size);
+        progress.consumeData(i->size);
     }
     progress.finishItem();
 }
@@ -3,9 +3,8 @@
 #include "common.hpp"
 #include "wadindex.hpp"
 #include "mod.hpp"
-#include <map>
-#include <unordered_map>
 #include <array>
+#include <vector>
 
 namespace LCS {
     struct WadMerge  {
@@ -40,13 +39,15 @@ namespace LCS {
             EntryKind kind_;
         };
         // Throws std::runtime_error
-        void addWadEntry(Wad::Entry const& entry, Wad const* source,
-                         Conflict conflict, EntryKind type);
+        // True when entry should replace current, current is nullptr for new entries
+        bool accept(Entry const* current, Wad::Entry const& entry, Wad const* source, Conflict conflict) const;
 
         fs::path path_;
         Wad const* original_;
-        std::map<uint64_t, Entry> entries_;
-        std::unordered_map<uint64_t, uint64_t> orgchecksum_;
+        // Sorted by xxhash
+        std::vector<Entry> entries_;
+        // Original xxhash and checksum pairs sorted by xxhash
+        std::vector<std::pair<std::uint64_t, std::uint64_t>> orgchecksum_;
         mutable std::uint64_t size_ = 0;
         mutable bool sizeCalculated_ = false;;
     };
@@ -1,11 +1,40 @@
 #include "wadmergequeue.hpp"
 #include "error.hpp"
+#include "parallel.hpp"
 #include "progress.hpp"
+#include <algorithm>
+#include <mutex>
 #include <set>
 #include <utility>
+#include <vector>
 
 using namespace LCS;
 
+namespace {
+    // Serializes progress reports of wads written at the same time, callers only keep running totals
+    struct SharedProgress : Progress {
+        SharedProgress(Progress& progress) noexcept : progress_(progress) {}
+
+        void startItem(fs::path const& path, std::uint64_t dataSize) noexcept override {
+            auto lock = std::lock_guard(mutex_);
+            progress_.startItem(path, dataSize);
+        }
+
+        void consumeData(std::uint64_t ammount) noexcept override {
+            auto lock = std::lock_guard(mutex_);
+            progress_.consumeData(ammount);
+        }
+
+        void finishItem() noexcept override {
+            auto lock = std::lock_guard(mutex_);
+            progress_.finishItem();
+        }
+    private:
+        Progress& progress_;
+        std::mutex mutex_;
+    };
+}
+
 WadMergeQueue::WadMergeQueue(fs::path const& path, WadIndex const& index) :
     path_(fs::absolute(path)), index_(index) {
     lcs_trace_func(
@@ -33,7 +62,7 @@ void WadMergeQueue::addWad(Wad const* source, Conflict conflict) {
     auto baseItem = findOrAddItem(baseWad);
     baseItem->addWad(source, conflict);
     for(auto const& entry: source->entries()) {
-        for(auto& [xxhash, extraWad]: index_.findExtra(entry.xxhash)) {
+        for(auto extraWad: index_.findExtra(entry.xxhash)) {
             if (extraWad != baseWad) {
                 auto extraItem = findOrAddItem(extraWad);
                 extraItem->addExtraEntry(entry, source, conflict);
@@ -42,17 +71,29 @@ void WadMergeQueue::addWad(Wad const* source, Conflict conflict) {
     }
 }
 
-void WadMergeQueue::write(ProgressMulti& progress) const {
+void WadMergeQueue::write(ProgressMulti& progress, std::size_t jobs) const {
+    lcs_trace_func(
+                lcs_trace_var(path_),
+                lcs_trace_var(jobs)
+                );
     std::size_t itemTotal = 0;
     std::uint64_t dataTotal = 0;
+    auto items = std::vector<WadMerge const*>{};
+    items.reserve(items_.size());
     for(auto const& [original, item]: items_) {
         itemTotal++;
         dataTotal += item->size();
+        items.push_back(item.get());
     }
+    // Every item has its own output and sources, biggest go first so the last one to start is small
+    std::stable_sort(items.begin(), items.end(), [] (WadMerge const* lhs, WadMerge const* rhs) {
+        return lhs->size() > rhs->size();
+    });
     progress.startMulti(itemTotal, dataTotal);
-    for(auto const& kvp: items_) {
-        kvp.second->write(progress);
-    }
+    auto shared = SharedProgress(progress);
+    parallel_for(items.size(), jobs, [&] (std::size_t index) {
+        items[index]->write(shared);
+    });
     progress.finishMulti();
 }
 
@@ -8,6 +8,9 @@
 
 namespace LCS {
     struct WadMergeQueue {
+        // Merging is mostly disk bound, more writers than this only fight over the drive
+        static constexpr std::size_t DEFAULT_WRITE_JOBS = 4;
+
         // Throws fs::filesystem_error
         WadMergeQueue(fs::path const& path, WadIndex const& index);
         WadMergeQueue(WadMergeQueue const&) = delete;
@@ -22,7 +25,8 @@ namespace LCS {
         void addWad(Wad const* source, Conflict conflict);
 
         // Throws std::runtime_error
-        void write(ProgressMulti& progress) const;
+        // Writes up to jobs wads at once, largest first, 0 uses all cores
+        void write(ProgressMulti& progress, std::size_t jobs = DEFAULT_WRITE_JOBS) const;
 
         // Throws fs::filesystem_error
         void cleanup();
@@ -1,9 +1,9 @@
 #include "wxyextract.hpp"
+#include "decoder.hpp"
 #include "error.hpp"
 #include "progress.hpp"
 #include "utility.hpp"
 #include "iofile.hpp"
-#include <miniz.h>
 #include <xxhash.h>
 #include <json.hpp>
 
@@ -92,21 +92,15 @@ void WxyExtract::decompressStr(std::u8string& str) const {
         return;
     }
     char buffer[1024];
-    mz_stream strm = {};
+    std::size_t size = 0;
     if (wxyVersion_ < 6) {
         str.insert(str.begin(), 0x78);
-        lcs_assert(mz_inflateInit2(&strm, 15) == MZ_OK);
+        size = Decoder::local().zlib(buffer, sizeof(buffer), str.data(), str.size());
     } else {
-        lcs_assert(mz_inflateInit2(&strm, -15) == MZ_OK);
+        size = Decoder::local().inflate_raw(buffer, sizeof(buffer), str.data(), str.size());
     }
-    strm.next_in = (unsigned char const*)(str.data());
-    strm.avail_in = (unsigned int)(str.size());
-    strm.next_out = (unsigned char*)buffer;
-    strm.avail_out = (unsigned int)(sizeof(buffer));
-    mz_inflate(&strm, MZ_FINISH);
-    mz_inflateEnd(&strm);
-    str.resize((size_t)strm.total_out);
-    std::copy(buffer, buffer + strm.total_out, str.data());
+    str.resize(size);
+    std::copy(buffer, buffer + size, str.data());
 }
 
 void WxyExtract::decryptStr(std::u8string& str) const {
@@ -378,6 +372,7 @@ void WxyExtract::extract_files(fs::path const& dest, Progress& progress) const {
     std::vector<char> compressedBuffer;
     uncompressedBuffer.resize(maxUncompressed+6);
     compressedBuffer.resize(maxCompressed+6);
+    auto& decoder = Decoder::local();
 
     for(auto const& entry: filesList_) {
         file_.seek(entry.offset, SEEK_SET);
@@ -395,24 +390,12 @@ void WxyExtract::extract_files(fs::path const& dest, Progress& progress) const {
             } else {
                 file_.read(compressedBuffer.data(), entry.compressedSize);
             }
-            mz_stream strm = {};
-            lcs_assert(mz_inflateInit2(&strm, 15) == MZ_OK);
-            strm.next_in = (unsigned char const*)compressedBuffer.data();
-            strm.avail_in = (unsigned int)(entry.compressedSize);
-            strm.next_out = (unsigned char*)uncompressedBuffer.data();
-            strm.avail_out = (unsigned int)(entry.uncompresedSize);
-            mz_inflate(&strm, MZ_FINISH);
-            mz_inflateEnd(&strm);
+            decoder.zlib(uncompressedBuffer.data(), (std::size_t)entry.uncompresedSize,
+                         compressedBuffer.data(), (std::size_t)entry.compressedSize);
         } else if(entry.compressionMethod == methodDeflate) {
             file_.read(compressedBuffer.data(), entry.compressedSize);
-            mz_stream strm = {};
-            lcs_assert(mz_inflateInit2(&strm, -15) == MZ_OK);
-            strm.next_in = (unsigned char const*)compressedBuffer.data();
-            strm.avail_in = (unsigned int)(entry.compressedSize);
-            strm.next_out = (unsigned char*)uncompressedBuffer.data();
-            strm.avail_out = (unsigned int)(entry.uncompresedSize);
-            mz_inflate(&strm, MZ_FINISH);
-            mz_inflateEnd(&strm);
+            decoder.inflate_raw(uncompressedBuffer.data(), (std::size_t)entry.uncompresedSize,
+                                compressedBuffer.data(), (std::size_t)entry.compressedSize);
         } else {
             throw_error("Unknow compression method!");
         }
@@ -466,16 +449,10 @@ void WxyExtract::extract_meta(fs::path const& dest, Progress& progress) const {
         }
         file_.seek(preview.offset, SEEK_SET);
         file_.read(compressedBuffer.data(), preview.size);
-        mz_stream strm = {};
-        lcs_assert(mz_inflateInit2(&strm, -15) == MZ_OK);
-        strm.next_in = (unsigned char const*)compressedBuffer.data();
-        strm.avail_in = (unsigned int)(preview.size);
-        strm.next_out = (unsigned char*)uncompressedBuffer.data();
-        strm.avail_out = (unsigned int)(uncompressedBuffer.size());
-        mz_inflate(&strm, MZ_FINISH);
-        mz_inflateEnd(&strm);
-
-        auto extension = ScanExtension(uncompressedBuffer.data(), (size_t)(strm.total_out));
+        auto const uncompressedSize = Decoder::local().inflate_raw(uncompressedBuffer.data(), uncompressedBuffer.size(),
+                                                                   compressedBuffer.data(), preview.size);
+
+        auto extension = ScanExtension(uncompressedBuffer.data(), uncompressedSize);
         if (!extension.empty()) {
             fs::path outpath = dest;
             if (!foundFirst && extension == u8"png") {
@@ -487,7 +464,7 @@ void WxyExtract::extract_meta(fs::path const& dest, Progress& progress) const {
                 i++;
             }
             auto outfile = OutFile(outpath);
-            outfile.write(uncompressedBuffer.data(), strm.total_out);
+            outfile.write(uncompressedBuffer.data(), uncompressedSize);
         }
 
         progress.consumeData((size_t)preview.size);
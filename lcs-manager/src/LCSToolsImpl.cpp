@@ -136,10 +136,14 @@ LCS::WadIndex const& LCSToolsImpl::wadIndex() {
         throw std::runtime_error("Game path not set!");
     }
 
-    while (wadIndex_ == nullptr || !wadIndex_->is_uptodate()) {
-        lcs_hint(u8"Is this Game path correct: ", leaguePath_.generic_u8string(), u8" ?\n",
-                 "Try repairing or reinstalling the Game!");
-        wadIndex_ = std::make_unique<LCS::WadIndex>(leaguePath_, blacklist_, ignorebad_);
+    lcs_hint(u8"Is this Game path correct: ", leaguePath_.generic_u8string(), u8" ?\n",
+             "Try repairing or reinstalling the Game!");
+    if (wadIndex_ == nullptr) {
+        wadIndex_ = std::make_unique<LCS::WadIndex>(leaguePath_, blacklist_, ignorebad_,
+                                                    progDirPath_ / "wadindex.cache");
+        QThread::msleep(250);
+    }
+    while (wadIndex_->refresh()) {
         QThread::msleep(250);
     }
 
@@ -382,7 +386,7 @@ void LCSToolsImpl::saveProfile(QString name, QJsonObject mods, bool run, bool sk
                     queue.addMod(i->second.get(), conflictStrategy);
                 }
             }
-            queue.write(*dynamic_cast<LCS::ProgressMulti*>(this));
+            queue.write(*dynamic_cast<LCS::ProgressMulti*>(this), profileWriteJobs_);
             queue.cleanup();
             writeCurrentProfile(name);
             writeProfile(name, mods);
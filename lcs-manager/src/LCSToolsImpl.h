@@ -95,6 +95,8 @@ private:
     LCSState state_ = LCSState::StateUnitialized;
     bool blacklist_ = true;
     bool ignorebad_ = false;
+    // Merged wads written at once when saving a profile
+    std::size_t profileWriteJobs_ = LCS::WadMergeQueue::DEFAULT_WRITE_JOBS;
     QString status_ = "";
     void setState(LCSState state);
     void setStatus(QString status);
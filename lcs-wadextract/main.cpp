@@ -1,4 +1,7 @@
+#include <algorithm>
+#include <charconv>
 #include <cstdio>
+#include <vector>
 #include <lcs/error.hpp>
 #include <lcs/progress.hpp>
 #include <lcs/wad.hpp>
@@ -20,13 +23,29 @@ using namespace LCS;
 
 make_main({
     try {
-        if (argc < 2) {
-            throw std::runtime_error("lolcustomskin-wadextract.exe <wad path> <optional: dest folder>");
+        std::vector<fs::path> args;
+        std::size_t jobs = 0;
+        for (int i = 1; i < argc; i++) {
+            auto const arg = fs::path(argv[i]);
+            if (arg == "--jobs") {
+                auto const value = i + 1 < argc ? fs::path(argv[++i]).string() : std::string{};
+                auto const result = std::from_chars(value.data(), value.data() + value.size(), jobs);
+                if (value.empty() || result.ec != std::errc{} || result.ptr != value.data() + value.size()) {
+                    throw std::runtime_error("--jobs expects a number!");
+                }
+            } else if (arg.string().starts_with("--")) {
+                throw std::runtime_error("Unknown option " + arg.string() + "!");
+            } else {
+                args.push_back(arg);
+            }
         }
-        fs::path source = argv[1];
+        if (args.size() < 1) {
+            throw std::runtime_error("lolcustomskin-wadextract.exe <wad path> <optional: dest folder> <optional: --jobs N>");
+        }
+        fs::path source = args[0];
         fs::path dest;
-        if (argc > 2) {
-            dest = argv[2];
+        if (args.size() > 1) {
+            dest = args[1];
         } else {
             dest = source;
             dest.replace_extension();
@@ -34,13 +53,28 @@ make_main({
         }
         fs::create_directories(dest);
 
-        HashTable hashtable = {};
-        hashtable.add_from_file(fs::path(argv[0]).parent_path() / "hashes.game.txt");
         print_path("Reading", source);
         Wad wad(source);
+
+        // Only names of this wad's own entries are ever looked up
+        auto xxhashes = std::vector<std::uint64_t>{};
+        for (auto const& entry: wad.entries()) {
+            xxhashes.push_back(entry.xxhash);
+        }
+        std::sort(xxhashes.begin(), xxhashes.end());
+        HashTable hashtable = {};
+        auto const hashes_txt = fs::path(argv[0]).parent_path() / "hashes.game.txt";
+        auto const hashes_bin = fs::path(argv[0]).parent_path() / "hashes.game.bin";
+        // Prefer the table compiled by lcs-hashcompile unless the text list was updated after it
+        if (fs::exists(hashes_bin)
+                && (!fs::exists(hashes_txt) || fs::last_write_time(hashes_bin) >= fs::last_write_time(hashes_txt))) {
+            hashtable.add_from_file(hashes_bin, xxhashes);
+        } else if (fs::exists(hashes_txt)) {
+            hashtable.add_from_file(hashes_txt, xxhashes);
+        }
         print_path("Extract", dest);
         Progress progress = {};
-        wad.extract(dest, hashtable, progress);
+        wad.extract(dest, hashtable, progress, jobs);
         printf("Finished!\n");
     } catch(std::runtime_error const& error) {
         error_print(error);
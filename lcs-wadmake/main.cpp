@@ -1,4 +1,6 @@
+#include <charconv>
 #include <cstdio>
+#include <vector>
 #include <lcs/error.hpp>
 #include <lcs/progress.hpp>
 #include <lcs/wad.hpp>
@@ -18,15 +20,77 @@ using namespace LCS;
 #define make_main(body) int main(int argc, char** argv) { body }
 #endif
 
+static int parse_int(fs::path const& arg, char const* error) {
+    auto const value = arg.string();
+    int result = 0;
+    auto const parsed = std::from_chars(value.data(), value.data() + value.size(), result);
+    if (parsed.ec != std::errc{} || parsed.ptr != value.data() + value.size()) {
+        throw std::runtime_error(error);
+    }
+    return result;
+}
+
 make_main({
+    std::vector<fs::path> args;
+    // Set by the first option, presets replace every option so they have to come before the rest
+    bool tuned = false;
     try {
-        if (argc < 2) {
-            throw std::runtime_error("lolcustomskin-wadmake.exe <folder path> <optional: wad path>");
+        WadMakeOptions options = {};
+        for (int i = 1; i < argc; i++) {
+            auto const arg = fs::path(argv[i]);
+            auto const next_arg = [&] {
+                if (i + 1 >= argc) {
+                    throw std::runtime_error(arg.string() + " expects a value!");
+                }
+                return fs::path(argv[++i]);
+            };
+            if (arg == "--fast" || arg == "--max") {
+                if (tuned) {
+                    throw std::runtime_error(arg.string() + " must come before other options!");
+                }
+                options = arg == "--fast" ? WadMakeOptions::fast() : WadMakeOptions::max();
+                tuned = true;
+                continue;
+            }
+            tuned = tuned || arg.string().starts_with("--");
+            if (arg == "--long") {
+                options.longDistance = true;
+            } else if (arg == "--dictionaries") {
+                options.dictionaryEntryMax = 4 * 1024;
+            } else if (arg == "--no-dedup") {
+                options.deduplicate = false;
+            } else if (arg == "--always-compress") {
+                options.storeIncompressible = false;
+            } else if (arg == "--cache") {
+                options.cache = next_arg();
+            } else if (arg == "--level") {
+                options.level = parse_int(next_arg(), "--level expects a number!");
+            } else if (arg == "--window-log") {
+                options.windowLog = parse_int(next_arg(), "--window-log expects a number!");
+            } else if (arg == "--policy") {
+                auto const extension = next_arg().generic_u8string();
+                auto const value = next_arg();
+                if (value == "store") {
+                    options.extensions.insert_or_assign(extension, WadMakeOptions::Policy { true, 0 });
+                } else {
+                    auto const level = parse_int(value, "--policy expects store or a number!");
+                    options.extensions.insert_or_assign(extension, WadMakeOptions::Policy { false, level });
+                }
+            } else if (arg.string().starts_with("--")) {
+                throw std::runtime_error("Unknown option " + arg.string() + "!");
+            } else {
+                args.push_back(arg);
+            }
+        }
+        if (args.size() < 1) {
+            throw std::runtime_error("lolcustomskin-wadmake.exe <folder path> <optional: wad path>"
+                                     " <optional: --fast | --max> <optional: --level N> <optional: --window-log N>"
+                                     " <optional: --long> <optional: --dictionaries> <optional: --no-dedup> <optional: --always-compress> <optional: --cache path> <optional: --policy .ext store|N>");
         }
-        fs::path source = argv[1];
+        fs::path source = args[0];
         fs::path dest;
-        if (argc > 2) {
-            dest = argv[2];
+        if (args.size() > 1) {
+            dest = args[1];
         } else {
             dest = source;
             dest.replace_extension(".wad.client");
@@ -34,14 +98,15 @@ make_main({
         fs::create_directories(dest.parent_path());
 
         print_path("Reading", source);
-        WadMake wadmake(source, nullptr, false);
+        WadMake wadmake(source, nullptr, false, options);
         print_path("Packing", dest);
         Progress progress = {};
         wadmake.write(dest, progress);
         printf("Finished!\n");
     } catch(std::runtime_error const& error) {
         error_print(error);
-        if (argc < 3) {
+        // Only runs from explorer wait, they come without options and with a folder at most
+        if (args.size() < 2 && !tuned) {
             printf("Press enter to exit...!\n");
             getc(stdin);
         }